@@ -0,0 +1,63 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef __DRM_BACKEND_H_
+#define __DRM_BACKEND_H_
+
+#include <stdint.h>
+
+#include "drm_common.h"
+
+/* Backends converting client cursors into scanout FBs */
+typedef struct {
+  const char *name;
+
+  /**
+   * Surfaces are pooled in size buckets within pool_size bytes, and the FBs
+   * would be larger than scaled_w x scaled_h then, with the cursor at the
+   * top-left corner. 0 for exact sized FBs.
+   * The cache_file stores backend states across runs, NULL to disable.
+   */
+  void *(*init_ctx)(int fd, int num_surfaces, int format, uint64_t modifier,
+                    uint32_t pool_size, const char *cache_file);
+  void (*free_ctx)(void *data);
+
+  /**
+   * Convert the client's ARGB8888 BO (w x h) into a new FB (scaled_w x
+   * scaled_h), shifted by (x, y).
+   * When *keep is set, the backend tries to keep the FB's buffer from
+   * reusing until released, and clears *keep if unable to.
+   * Returns 0 with errno EBUSY when all buffers are held by FBs not yet
+   * released, to retry after the display retired some.
+   */
+  uint32_t (*convert_fb)(int fd, void *data, uint32_t handle, int w, int h,
+                         int scaled_w, int scaled_h, int x, int y, int *keep);
+
+  /**
+   * Called for every FB once retired by the display (or evicted if kept),
+   * so that backends could hold the buffers until then.
+   */
+  void (*release_fb)(void *data, uint32_t fb);
+
+  /* Take the fence of the last FB's rendering, -1 for none (optional) */
+  int (*take_fence)(void *data);
+
+  /* Drop resources of the client BO, replaced by a new cursor (optional) */
+  void (*invalidate)(void *data, uint32_t handle);
+} drm_backend;
+
+drm_private extern const drm_backend egl_backend;
+drm_private extern const drm_backend cpu_backend;
+
+#endif
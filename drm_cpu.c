@@ -0,0 +1,599 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/dma-buf.h>
+
+#include <drm.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
+#endif
+
+#include "drm_backend.h"
+#include "drm_common.h"
+#include "drm_cpu.h"
+
+/* Rotating buffers like the EGL backend's surfaces */
+#define MAX_NUM_BUFFERS 64
+
+/* Leave enough free buffers for rendering */
+#define MIN_FREE_BUFFERS 2
+
+/* Size buckets of buffers, like the EGL backend's surface pool */
+#define BUCKET_ALIGN 64
+
+/* Bilinear weights, fitting NEON's 8-bit multiplies */
+#define WEIGHT_BITS 7
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+
+typedef struct {
+  uint32_t handle;
+  uint32_t pitch;
+  uint64_t size;
+  uint8_t *map;
+
+  /* Kept from reusing until retired, or for cached FB */
+  uint32_t fb;
+  int cached;
+} cpu_buffer;
+
+typedef struct {
+  int fd;
+  int format;
+
+  int width;
+  int height;
+
+  /* Size of buffers, 0 for exact sized buffers */
+  uint32_t pool_size;
+  int buf_width;
+  int buf_height;
+
+  cpu_buffer buffers[MAX_NUM_BUFFERS];
+  int current_buffer;
+  int num_buffers;
+
+  /* Horizontally scaled source rows for bilinear scaling */
+  uint8_t *rows[2];
+  int row_y[2];
+
+  /* Use the SIMD kernels, cleared when benchmarking the scalar ones */
+  int simd;
+} cpu_ctx;
+
+static inline uint32_t cpu_swizzle(uint32_t pixel)
+{
+  /* ARGB8888 <-> ABGR8888 */
+  return (pixel & 0xff00ff00) |
+    ((pixel >> 16) & 0xff) | ((pixel & 0xff) << 16);
+}
+
+static void cpu_copy_row(uint32_t *dst, const uint32_t *src, int n, int swap,
+                         int simd)
+{
+  int i = 0;
+
+  if (!swap) {
+    memcpy(dst, src, n * 4);
+    return;
+  }
+
+#if defined(__ARM_NEON)
+  for (; simd && i + 16 <= n; i += 16) {
+    uint8x16x4_t v = vld4q_u8((const uint8_t *)(src + i));
+    uint8x16_t tmp = v.val[0];
+
+    v.val[0] = v.val[2];
+    v.val[2] = tmp;
+    vst4q_u8((uint8_t *)(dst + i), v);
+  }
+#elif defined(__SSSE3__)
+  const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7,
+                                     10, 9, 8, 11, 14, 13, 12, 15);
+
+  for (; simd && i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_shuffle_epi8(v, mask));
+  }
+#else
+  (void)simd;
+#endif
+
+  for (; i < n; i++)
+    dst[i] = cpu_swizzle(src[i]);
+}
+
+/* dst = a * (1 - f) + b * f, for each byte */
+static void cpu_blend_rows(uint8_t *dst, const uint8_t *a, const uint8_t *b,
+                           int n, int f, int simd)
+{
+  int i = 0;
+
+  if (!f) {
+    memcpy(dst, a, n);
+    return;
+  }
+
+#if defined(__ARM_NEON)
+  const uint8x8_t wa = vdup_n_u8(WEIGHT_ONE - f);
+  const uint8x8_t wb = vdup_n_u8(f);
+
+  for (; simd && i + 8 <= n; i += 8) {
+    uint16x8_t v = vmull_u8(vld1_u8(a + i), wa);
+
+    v = vmlal_u8(v, vld1_u8(b + i), wb);
+    vst1_u8(dst + i, vrshrn_n_u16(v, WEIGHT_BITS));
+  }
+#elif defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i wa = _mm_set1_epi16(WEIGHT_ONE - f);
+  const __m128i wb = _mm_set1_epi16(f);
+  const __m128i round = _mm_set1_epi16(WEIGHT_ONE / 2);
+
+  for (; simd && i + 16 <= n; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    __m128i lo, hi;
+
+    lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa),
+                       _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), wb));
+    hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa),
+                       _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), wb));
+
+    lo = _mm_srli_epi16(_mm_add_epi16(lo, round), WEIGHT_BITS);
+    hi = _mm_srli_epi16(_mm_add_epi16(hi, round), WEIGHT_BITS);
+    _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+  }
+#else
+  (void)simd;
+#endif
+
+  for (; i < n; i++)
+    dst[i] = (a[i] * (WEIGHT_ONE - f) + b[i] * f + WEIGHT_ONE / 2)
+      >> WEIGHT_BITS;
+}
+
+/* Map dst pixel i to src pixels, sampling at pixel centers like GL_LINEAR */
+static inline void cpu_map_coord(int i, int64_t step, int size,
+                                 int *i0, int *i1, int *f)
+{
+  int64_t pos = i * step + step / 2 - (1 << 15);
+
+  if (pos <= 0) {
+    *i0 = *i1 = 0;
+    *f = 0;
+    return;
+  }
+
+  *i0 = pos >> 16;
+  *i1 = *i0 + 1 < size ? *i0 + 1 : size - 1;
+  *f = (pos & 0xffff) >> (16 - WEIGHT_BITS);
+}
+
+static void cpu_scale_row(uint8_t *dst, const uint32_t *src, int w,
+                          int scaled_w, int swap)
+{
+  int64_t step = ((int64_t) w << 16) / scaled_w;
+  int i, c, x0, x1, f;
+
+  for (i = 0; i < scaled_w; i++) {
+    uint32_t p0, p1;
+
+    cpu_map_coord(i, step, w, &x0, &x1, &f);
+
+    p0 = swap ? cpu_swizzle(src[x0]) : src[x0];
+    p1 = swap ? cpu_swizzle(src[x1]) : src[x1];
+
+    for (c = 0; c < 4; c++) {
+      uint32_t v0 = (p0 >> (c * 8)) & 0xff;
+      uint32_t v1 = (p1 >> (c * 8)) & 0xff;
+
+      dst[i * 4 + c] = (v0 * (WEIGHT_ONE - f) + v1 * f + WEIGHT_ONE / 2)
+        >> WEIGHT_BITS;
+    }
+  }
+}
+
+static const uint8_t *cpu_get_row(cpu_ctx *ctx, const uint32_t *src,
+                                  int w, int y, int keep_y, int swap)
+{
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (ctx->row_y[i] == y)
+      return ctx->rows[i];
+  }
+
+  /* Don't replace the other row in use */
+  i = ctx->row_y[0] == keep_y ? 1 : 0;
+
+  cpu_scale_row(ctx->rows[i], src + y * w, w, ctx->width, swap);
+  ctx->row_y[i] = y;
+  return ctx->rows[i];
+}
+
+static void cpu_render(cpu_ctx *ctx, cpu_buffer *buf, const uint32_t *src,
+                       int w, int h, int x, int y)
+{
+  int swap = ctx->format != DRM_FORMAT_ARGB8888;
+  int scaled = w != ctx->width || h != ctx->height;
+  int64_t step = ((int64_t) h << 16) / ctx->height;
+  int x0 = x > 0 ? x : 0;
+  int x1 = x < 0 ? ctx->width + x : ctx->width;
+  int n = x1 - x0;
+  int i, sy, y0, y1, f;
+
+  ctx->row_y[0] = ctx->row_y[1] = -1;
+
+  for (i = 0; i < ctx->height; i++) {
+    uint8_t *row = buf->map + i * buf->pitch;
+    const uint8_t *a, *b;
+
+    /* Row of the scaled image */
+    sy = i - y;
+
+    /* Clear the uncovered area */
+    if (sy < 0 || sy >= ctx->height || n <= 0) {
+      memset(row, 0, ctx->width * 4);
+      continue;
+    }
+
+    memset(row, 0, x0 * 4);
+    memset(row + x1 * 4, 0, (ctx->width - x1) * 4);
+    row += x0 * 4;
+
+    if (!scaled) {
+      cpu_copy_row((uint32_t *) row, src + sy * w + x0 - x, n, swap,
+                   ctx->simd);
+      continue;
+    }
+
+    cpu_map_coord(sy, step, h, &y0, &y1, &f);
+    a = cpu_get_row(ctx, src, w, y0, y1, swap);
+    b = cpu_get_row(ctx, src, w, y1, y0, swap);
+
+    cpu_blend_rows(row, a + (x0 - x) * 4, b + (x0 - x) * 4, n * 4, f,
+                   ctx->simd);
+  }
+}
+
+/* Render into memory, for comparing the SIMD and scalar kernels */
+drm_private int cpu_render_image(uint32_t *dst, const uint32_t *src,
+                                 int w, int h, int scaled_w, int scaled_h,
+                                 int format, int simd)
+{
+  cpu_ctx ctx = {
+    .format = format,
+    .width = scaled_w,
+    .height = scaled_h,
+    .simd = simd,
+  };
+  cpu_buffer buf = {
+    .pitch = scaled_w * 4,
+    .map = (uint8_t *) dst,
+  };
+  int ret = -1;
+
+  ctx.rows[0] = malloc(scaled_w * 4);
+  ctx.rows[1] = malloc(scaled_w * 4);
+  if (ctx.rows[0] && ctx.rows[1]) {
+    cpu_render(&ctx, &buf, src, w, h, 0, 0);
+    ret = 0;
+  }
+
+  free(ctx.rows[0]);
+  free(ctx.rows[1]);
+  return ret;
+}
+
+static void cpu_destroy_buffer(cpu_ctx *ctx, cpu_buffer *buf)
+{
+  struct drm_mode_destroy_dumb destroy = { 0, };
+
+  if (buf->map)
+    munmap(buf->map, buf->size);
+
+  /* The FB still holds the buffer when kept */
+  if (buf->handle) {
+    destroy.handle = buf->handle;
+    drmIoctl(ctx->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+  }
+
+  memset(buf, 0, sizeof(*buf));
+}
+
+static int cpu_create_buffer(cpu_ctx *ctx, cpu_buffer *buf)
+{
+  struct drm_mode_create_dumb create = { 0, };
+  struct drm_mode_map_dumb map = { 0, };
+  void *ptr;
+
+  create.width = ctx->buf_width;
+  create.height = ctx->buf_height;
+  create.bpp = 32;
+
+  if (drmIoctl(ctx->fd, DRM_IOCTL_MODE_CREATE_DUMB, &create) < 0) {
+    DRM_ERROR("failed to create dumb buffer (%d)\n", errno);
+    return -1;
+  }
+
+  buf->handle = create.handle;
+  buf->pitch = create.pitch;
+  buf->size = create.size;
+
+  map.handle = buf->handle;
+  if (drmIoctl(ctx->fd, DRM_IOCTL_MODE_MAP_DUMB, &map) < 0) {
+    DRM_ERROR("failed to map dumb buffer (%d)\n", errno);
+    goto err;
+  }
+
+  ptr = mmap(NULL, buf->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+             ctx->fd, map.offset);
+  if (ptr == MAP_FAILED) {
+    DRM_ERROR("failed to mmap dumb buffer (%d)\n", errno);
+    goto err;
+  }
+
+  buf->map = ptr;
+  return 0;
+err:
+  cpu_destroy_buffer(ctx, buf);
+  return -1;
+}
+
+static int cpu_resize(cpu_ctx *ctx, int width, int height)
+{
+  int buf_width = width, buf_height = height;
+  int i;
+
+  /* Buffers of a larger bucket could hold smaller sizes */
+  if (ctx->pool_size) {
+    buf_width = (width + BUCKET_ALIGN - 1) / BUCKET_ALIGN * BUCKET_ALIGN;
+    buf_height = (height + BUCKET_ALIGN - 1) / BUCKET_ALIGN * BUCKET_ALIGN;
+
+    /* Too large for the budget */
+    if ((uint32_t) (buf_width * buf_height * 4 * ctx->num_buffers) >
+        ctx->pool_size) {
+      DRM_INFO("buffers of (%dx%d) exceed the pool budget: %dKB > %uKB\n",
+               buf_width, buf_height,
+               buf_width * buf_height * 4 * ctx->num_buffers / 1024,
+               ctx->pool_size / 1024);
+      buf_width = width;
+      buf_height = height;
+    }
+  }
+
+  /* Re-create buffers lazily */
+  if (ctx->buf_width != buf_width || ctx->buf_height != buf_height) {
+    for (i = 0; i < ctx->num_buffers; i++)
+      cpu_destroy_buffer(ctx, &ctx->buffers[i]);
+
+    ctx->buf_width = buf_width;
+    ctx->buf_height = buf_height;
+  }
+
+  ctx->width = width;
+  ctx->height = height;
+
+  for (i = 0; i < 2; i++) {
+    free(ctx->rows[i]);
+    ctx->rows[i] = malloc(width * 4);
+    if (!ctx->rows[i])
+      return -1;
+  }
+
+  ctx->current_buffer = 0;
+  return 0;
+}
+
+static cpu_buffer *cpu_get_buffer(cpu_ctx *ctx)
+{
+  cpu_buffer *buf;
+  int i;
+
+  for (i = 0; i < ctx->num_buffers; i++) {
+    ctx->current_buffer = (ctx->current_buffer + 1) % ctx->num_buffers;
+
+    /* Skip kept buffers */
+    buf = &ctx->buffers[ctx->current_buffer];
+    if (buf->fb)
+      continue;
+
+    if (!buf->map && cpu_create_buffer(ctx, buf) < 0)
+      return NULL;
+
+    return buf;
+  }
+
+  /* Never render into buffers not yet retired, they might be on screen */
+  DRM_DEBUG("buffers exhausted\n");
+  errno = EBUSY;
+  return NULL;
+}
+
+static int cpu_num_free_buffers(cpu_ctx *ctx)
+{
+  int i, num = 0;
+
+  for (i = 0; i < ctx->num_buffers; i++) {
+    if (!ctx->buffers[i].fb)
+      num++;
+  }
+
+  return num;
+}
+
+drm_private void cpu_free_ctx(void *data)
+{
+  cpu_ctx *ctx = data;
+  int i;
+
+  for (i = 0; i < ctx->num_buffers; i++)
+    cpu_destroy_buffer(ctx, &ctx->buffers[i]);
+
+  free(ctx->rows[0]);
+  free(ctx->rows[1]);
+  free(ctx);
+}
+
+drm_private void *cpu_init_ctx(int fd, int num_buffers, int format,
+                               uint64_t modifier, uint32_t pool_size,
+                               const char *cache_file)
+{
+  cpu_ctx *ctx;
+
+  /* Nothing to cache across runs */
+  (void)cache_file;
+
+  if (num_buffers > MAX_NUM_BUFFERS) {
+    DRM_ERROR("too much buffers: %d > %d\n", num_buffers, MAX_NUM_BUFFERS);
+    return NULL;
+  }
+
+  /* Dumb buffers are linear */
+  if (modifier) {
+    DRM_ERROR("modifier 0x%"PRIx64" not supported\n", modifier);
+    return NULL;
+  }
+
+  if (format != DRM_FORMAT_ARGB8888 && format != DRM_FORMAT_ABGR8888) {
+    DRM_ERROR("format 0x%x not supported\n", format);
+    return NULL;
+  }
+
+  ctx = calloc(1, sizeof(*ctx));
+  if (!ctx) {
+    DRM_ERROR("failed to alloc ctx\n");
+    return NULL;
+  }
+
+  ctx->fd = fd;
+  ctx->format = format;
+  ctx->num_buffers = num_buffers;
+  ctx->pool_size = pool_size;
+  ctx->simd = 1;
+  return ctx;
+}
+
+drm_private void cpu_release_fb(void *data, uint32_t fb)
+{
+  cpu_ctx *ctx = data;
+  int i;
+
+  for (i = 0; i < ctx->num_buffers; i++) {
+    if (ctx->buffers[i].fb == fb) {
+      ctx->buffers[i].fb = 0;
+      ctx->buffers[i].cached = 0;
+      return;
+    }
+  }
+}
+
+drm_private uint32_t cpu_convert_fb(int fd, void *data, uint32_t handle,
+                                    int w, int h, int scaled_w, int scaled_h,
+                                    int x, int y, int *keep)
+{
+  cpu_ctx *ctx = data;
+  struct dma_buf_sync sync = { 0, };
+  uint32_t handles[4] = { 0 };
+  uint32_t pitches[4] = { 0 };
+  uint32_t offsets[4] = { 0 };
+  size_t size = w * h * 4;
+  int want_keep = keep && *keep;
+  const uint32_t *src;
+  cpu_buffer *buf;
+  uint32_t fb = 0;
+  int dma_fd;
+
+  if (keep)
+    *keep = 0;
+
+  if (ctx->width != scaled_w || ctx->height != scaled_h) {
+    if (cpu_resize(ctx, scaled_w, scaled_h) < 0) {
+      DRM_ERROR("failed to resize to (%dx%d)\n", scaled_w, scaled_h);
+      return 0;
+    }
+  }
+
+  buf = cpu_get_buffer(ctx);
+  if (!buf) {
+    if (errno != EBUSY)
+      DRM_ERROR("failed to get buffer\n");
+    return 0;
+  }
+
+  if (drmPrimeHandleToFD(fd, handle, DRM_CLOEXEC, &dma_fd) < 0) {
+    DRM_ERROR("failed to get dma fd (-%d)\n", errno);
+    return 0;
+  }
+
+  src = mmap(NULL, size, PROT_READ, MAP_SHARED, dma_fd, 0);
+  if (src == MAP_FAILED) {
+    DRM_ERROR("failed to map cursor (%d)\n", errno);
+    goto out_close_fd;
+  }
+
+  sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+  ioctl(dma_fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+  cpu_render(ctx, buf, src, w, h, x, y);
+
+  sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+  ioctl(dma_fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+  munmap((void *) src, size);
+
+  handles[0] = buf->handle;
+  pitches[0] = buf->pitch;
+  if (drmModeAddFB2(fd, ctx->buf_width, ctx->buf_height, ctx->format,
+                    handles, pitches, offsets, &fb, 0) < 0) {
+    DRM_ERROR("failed to add fb (%d)\n", errno);
+    fb = 0;
+    goto out_close_fd;
+  }
+
+  /* Keep the buffer from reusing until retired, or cached when requested */
+  buf->fb = fb;
+  if (want_keep && cpu_num_free_buffers(ctx) >= MIN_FREE_BUFFERS) {
+    buf->cached = 1;
+    *keep = 1;
+  }
+
+out_close_fd:
+  close(dma_fd);
+  return fb;
+}
+
+drm_private const drm_backend cpu_backend = {
+  .name = "cpu",
+  .init_ctx = cpu_init_ctx,
+  .free_ctx = cpu_free_ctx,
+  .convert_fb = cpu_convert_fb,
+  .release_fb = cpu_release_fb,
+};
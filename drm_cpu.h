@@ -0,0 +1,28 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef __DRM_CPU_H_
+#define __DRM_CPU_H_
+
+#include <stdint.h>
+
+#include "drm_common.h"
+
+drm_private void *cpu_init_ctx(int fd, int num_buffers, int format, uint64_t modifier, uint32_t pool_size, const char *cache_file);
+drm_private void cpu_free_ctx(void *data);
+drm_private uint32_t cpu_convert_fb(int fd, void *data, uint32_t handle, int w, int h, int scaled_w, int scaled_h, int x, int y, int *keep);
+drm_private void cpu_release_fb(void *data, uint32_t fb);
+drm_private int cpu_render_image(uint32_t *dst, const uint32_t *src, int w, int h, int scaled_w, int scaled_h, int format, int simd);
+
+#endif
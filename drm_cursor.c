@@ -12,23 +12,40 @@
  *  GNU General Public License for more details.
  */
 
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
+#include <sys/utsname.h>
+
+#include <linux/dma-buf.h>
+#include <linux/kcmp.h>
+#include <linux/netlink.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
 #include <gbm.h>
 
+#include "drm_backend.h"
 #include "drm_common.h"
-#include "drm_egl.h"
+#include "drm_cursor.h"
+#include "drm_hash.h"
 
 #define DRM_CURSOR_CONFIG_FILE "/etc/drm-cursor.conf"
 #define OPT_DEBUG "debug="
@@ -44,15 +61,72 @@
 #define OPT_ATOMIC "atomic="
 #define OPT_SCALE "scale="
 #define OPT_SCALE_FROM "scale-from="
+#define OPT_SINGLE_THREAD "single-thread="
+#define OPT_FLIP_PACING "flip-pacing="
+#define OPT_LATCH_MARGIN_US "latch-margin-us="
+#define OPT_CACHE "cache="
+#define OPT_CACHE_FILE "cache-file="
+#define OPT_FB_CACHE_KB "fb-cache-kb="
+#define OPT_EDGE_CLIP "edge-clip="
+#define OPT_BACKEND "backend="
+#define OPT_DIRECT_SCANOUT "direct-scanout="
+#define OPT_SURFACE_POOL_KB "surface-pool-kb="
+#define OPT_PLANE_SCALING "plane-scaling="
+#define OPT_BATCH_COMMITS "batch-commits="
+#define OPT_UEVENT_MODES "uevent-modes="
+#define OPT_ASYNC_SET "async-set="
+#define OPT_PREWARM "prewarm="
 
 #define DRM_MAX_CRTCS 8
 
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+#define NSEC_PER_USEC 1000ULL
+
+/* Give up waiting for a flip that never completes */
+#define DRM_FLIP_TIMEOUT (100 * NSEC_PER_MSEC)
+
+/* Report late latching phase errors every N measurements */
+#define DRM_LATCH_REPORT_COUNT 600
+
+/* Max converted FBs cached per CRTC */
+#define DRM_FB_CACHE_MAX 16
+
+/* Report FB cache hit rates every N lookups */
+#define DRM_FB_CACHE_REPORT_COUNT 1000
+
+/* Max DRM devices, each with its own ctx */
+#define DRM_MAX_DEVICES 4
+
+/* Max client fds remembered */
+#define DRM_MAX_FDS 16
+
+/* Retry commits failed transiently (EBUSY, etc.) after this */
+#define DRM_COMMIT_RETRY_TIME (2 * NSEC_PER_MSEC)
+
+/* Give up converting after N retries without retired buffers */
+#define DRM_MAX_CONVERT_RETRIES 50
+
+/* Fall back to legacy APIs after N consecutive atomic failures */
+#define DRM_MAX_ATOMIC_FAILURES 3
+
+#define DRM_COMMIT_TRANSIENT(err) \
+  ((err) == EBUSY || (err) == EINTR || (err) == EAGAIN)
+
+/* Max FBs waiting for the flip retiring them */
+#define DRM_MAX_RETIRING_FBS 4
+
+/* Max frames of animated cursors */
+#define DRM_MAX_ANIM_FRAMES DRM_CURSOR_MAX_FRAMES
+
 typedef enum {
   PLANE_PROP_type = 0,
   PLANE_PROP_IN_FORMATS,
   PLANE_PROP_zpos,
   PLANE_PROP_ZPOS,
   PLANE_PROP_ASYNC_COMMIT,
+  PLANE_PROP_IN_FENCE_FD,
   PLANE_PROP_CRTC_ID,
   PLANE_PROP_FB_ID,
   PLANE_PROP_SRC_X,
@@ -72,6 +146,7 @@ static const char *drm_plane_prop_names[] = {
   [PLANE_PROP_zpos] = "zpos",
   [PLANE_PROP_ZPOS] = "ZPOS",
   [PLANE_PROP_ASYNC_COMMIT] = "ASYNC_COMMIT",
+  [PLANE_PROP_IN_FENCE_FD] = "IN_FENCE_FD",
   [PLANE_PROP_CRTC_ID] = "CRTC_ID",
   [PLANE_PROP_FB_ID] = "FB_ID",
   [PLANE_PROP_SRC_X] = "SRC_X",
@@ -84,18 +159,74 @@ static const char *drm_plane_prop_names[] = {
   [PLANE_PROP_CRTC_H] = "CRTC_H",
 };
 
+typedef struct {
+  uint32_t prop_id; /* 0 for unavailable */
+  uint64_t value; /* Only for immutable props, others change at runtime */
+  uint64_t min;
+  uint64_t max; /* Range max or the last enum value */
+} drm_prop_info;
+
+/* Device-wide plane catalog, built once */
 typedef struct {
   uint32_t plane_id;
-  int cursor_plane;
+  uint32_t possible_crtcs;
   int can_afbc;
   int can_linear;
-  drmModePlane *plane;
-  drmModeObjectProperties *props;
-  int prop_ids[PLANE_PROP_MAX];
+  drm_prop_info props[PLANE_PROP_MAX];
+} drm_plane_info;
+
+/* Persistent cache of the plane catalog and the chosen planes */
+#define DRM_CACHE_MAGIC 0x43435244 /* "DRCC" */
+#define DRM_CACHE_VERSION 3
+
+typedef struct {
+  uint64_t dev;
+  char driver[32];
+  int32_t driver_version[3];
+  char kernel[65];
+} drm_cache_key;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  drm_cache_key key;
+  uint32_t catalog_atomic;
+  uint32_t num_planes;
+  struct {
+    uint32_t crtc_id;
+    uint32_t plane_id;
+  } crtcs[DRM_MAX_CRTCS];
+  /* Followed by drm_plane_info[num_planes] */
+} drm_cache_header;
+
+/* Plane update deferred into the loop's batched commit */
+typedef struct {
+  uint32_t fb;
+  int src_x, src_y, src_w, src_h;
+  int x, y, w, h;
+  uint64_t values[PLANE_PROP_MAX];
+  int fenced;
+} drm_plane_update;
+
+typedef struct {
+  uint32_t plane_id;
+  int cursor_plane;
+  drm_plane_info *info;
+
+  /* Reusable atomic request and the last committed values */
+  drmModeAtomicReq *req;
+  uint64_t commit_values[PLANE_PROP_MAX];
+  int committed;
+
+  /* The request is built but not committed yet, batched or busy */
+  drm_plane_update batch;
+  int batched;
 } drm_plane;
 
 #define REQ_SET_CURSOR  (1 << 0)
 #define REQ_MOVE_CURSOR (1 << 1)
+#define REQ_ANIMATE     (1 << 2)
+#define REQ_RESET       (1 << 3)
 
 typedef struct {
   uint32_t handle;
@@ -119,15 +250,94 @@ typedef struct {
   int hot_x;
   int hot_y;
 
+  /* Content hash of the cursor BO, 0 for unknown */
+  uint64_t hash;
+
+  /* The FB is unscaled, scaled by the plane */
+  int hw_scaled;
+
+  /* The FB wraps the client BO directly */
+  int direct;
+
   int request;
 } drm_cursor_state;
 
+typedef struct {
+  uint32_t handle;
+  uint64_t duration;
+  uint64_t hash;
+
+  /* Direct FB held while animating, cached FBs are looked up instead */
+  uint32_t fb;
+  int hw_scaled;
+} drm_anim_frame;
+
+typedef struct {
+  uint32_t fb;
+  uint32_t size;
+  uint64_t last_used;
+
+  /* The handle converted from, not a key */
+  uint32_t handle;
+
+  /* Keys, the same content from any handle shares the FB */
+  uint64_t hash;
+  int width;
+  int height;
+  int scaled_w;
+  int scaled_h;
+  int off_x;
+  int off_y;
+} drm_fb_entry;
+
 typedef enum {
   IDLE = 0,
   FATAL_ERROR,
-  PENDING,
 } drm_thread_state;
 
+/* Cursor position packed for single atomic stores */
+#define DRM_CURSOR_POS(x, y) \
+  (((uint64_t)(uint32_t)(x) << 32) | (uint32_t)(y))
+#define DRM_CURSOR_POS_X(pos) ((int)(uint32_t)((pos) >> 32))
+#define DRM_CURSOR_POS_Y(pos) ((int)(uint32_t)(pos))
+
+typedef struct drm_ctx drm_ctx;
+
+/* Epoll event data: (type << 32 | index of ctx->crtcs) */
+#define LOOP_EVENT(type, idx) (((uint64_t)(type) << 32) | (idx))
+#define LOOP_EVENT_TYPE(data) ((int)((data) >> 32))
+#define LOOP_EVENT_IDX(data) ((int)(uint32_t)(data))
+
+typedef enum {
+  LOOP_EVENT_REQUEST = 0,
+  LOOP_EVENT_FLIP,
+  LOOP_EVENT_TIMER,
+  LOOP_EVENT_UEVENT,
+} drm_loop_event;
+
+typedef struct {
+  pthread_t thread;
+  int epoll_fd;
+
+  /* Absolute CLOCK_MONOTONIC deadline of the earliest paced CRTC */
+  int timer_fd;
+  uint64_t deadline;
+
+  /* Mask of served CRTCs (index of ctx->crtcs) */
+  atomic_uint crtcs;
+
+  /* Merged atomic request of all CRTCs' updates, NULL to commit each */
+  drmModeAtomicReq *batch_req;
+
+  drm_ctx *ctx;
+
+  /* Watching the ctx's uevent socket */
+  int uevent;
+
+  /* For naming the per-CRTC loop */
+  uint32_t crtc_id;
+} drm_loop;
+
 typedef struct {
   uint32_t crtc_id;
   uint32_t crtc_pipe;
@@ -135,30 +345,153 @@ typedef struct {
   int width;
   int height;
 
+  /* The ctx's mode_gen when the mode above was fetched */
+  unsigned mode_gen;
+
   drm_plane *plane;
   uint32_t prefer_plane_id;
 
+  /**
+   * Latest-wins mailbox between the hooks and the thread:
+   * the set-cursor fields of cursor_next are guarded by the next_seq seqlock
+   * (writers serialized by mutex), the position is a single atomic word, and
+   * next_request collects the pending requests.
+   * Only the caller turning next_request from empty to non-empty kicks the
+   * event_fd, so moving never blocks on the thread.
+   */
   drm_cursor_state cursor_next;
+  atomic_uint next_seq;
+  atomic_uint_least64_t next_pos;
+  atomic_int next_request;
+  int event_fd;
+
   drm_cursor_state cursor_curr;
 
-  pthread_t thread;
+  drm_loop *loop;
+  int ready;
+
   pthread_cond_t cond;
   pthread_mutex_t mutex;
-  drm_thread_state state;
+  _Atomic drm_thread_state state;
 
-  void *egl_ctx;
+  /* FB converting backend */
+  const drm_backend *backend;
+  void *backend_ctx;
 
   int verified;
 
+  /**
+   * The set-cursor was deferred until the CRTC is available, guarded by
+   * mutex. The thread's own retry stays in cursor_curr, never touched by
+   * the callers.
+   */
+  int set_deferred;
+
+  /* Handed back to the real hardware cursor, after failing in async mode */
+  int hw_cursor;
+
+  /* Stopping for switching fd, not failed */
+  int resetting;
+
+  /* Prepared ahead of the first cursor, and the time it took */
+  int prewarm;
+  uint64_t prewarm_time;
+
+  /* Edge clipping by plane SRC rect: 1 supported, 0 not, -1 unknown */
+  int src_clip;
+
+  /* Scanning out client BOs directly: 1 supported, 0 not, -1 unknown */
+  int direct_scanout;
+
+  /**
+   * Scaling by the plane: 1 supported, 0 not, -1 unknown, for the ratio of
+   * the last probing
+   */
+  int hw_scale;
+  int hw_scale_src_w, hw_scale_src_h;
+  int hw_scale_dst_w, hw_scale_dst_h;
+
   int use_afbc_modifier;
   int blocked;
   int async_commit;
 
+  /* Defer atomic commits into the loop's batched commit */
+  int batching;
+
+  /* The deferred commit failed transiently, retry after this */
+  uint64_t commit_retry_time;
+
+  /* The backend ran out of retired buffers, retry the request later */
+  int convert_busy;
+  int convert_retries;
+
+  /**
+   * Flip pacing: the CRTC's OUT_FENCE_PTR fence of the last commit signals
+   * its completion, new requests coalesce until then.
+   */
+  int flip_pacing;
+  uint32_t out_fence_prop;
+  int32_t out_fence;
+  int flip_fence;
+  uint64_t flip_time;
+
+  /* Rendering fence of the FB, passed as the plane's IN_FENCE_FD */
+  int render_fence;
+  uint32_t render_fence_fb;
+
+  /* FBs replaced on screen, released once the flip retired them */
+  uint32_t retiring_fbs[DRM_MAX_RETIRING_FBS];
+  int num_retiring;
+
+  /* Frames of the last set-cursor request, guarded by mutex */
+  drm_anim_frame anim_pending[DRM_MAX_ANIM_FRAMES];
+  int anim_pending_num;
+
+  /* Animated cursor cycled by the thread */
+  drm_anim_frame anim_frames[DRM_MAX_ANIM_FRAMES];
+  int anim_num;
+  int anim_index;
+  uint64_t anim_time;
+
+  /* Late latching, learned from vblank timestamps */
+  uint32_t vblank_seq;
+  uint64_t vblank_time;
+  uint64_t vblank_period;
+  uint64_t latch_time;
+  uint32_t latch_seq;
+  uint64_t latch_vblank;
+  int latch_measuring;
+
+  /* Phase error stats of the latched commits */
+  int64_t latch_error_sum;
+  int64_t latch_error_max;
+  int64_t latch_slack_sum;
+  int latch_count;
+  int latch_missed;
+
   uint64_t last_update_time;
+
+  /* The plane chosen last time, from the cache */
+  uint32_t cached_plane_id;
+
+  /* LRU of converted FBs */
+  drm_fb_entry fb_cache[DRM_FB_CACHE_MAX];
+  uint32_t fb_cache_size;
+  uint64_t fb_cache_tick;
+  uint32_t fb_cache_hits;
+  uint32_t fb_cache_misses;
+
+  /* Hits of the same content from other handles */
+  uint32_t fb_cache_dedups;
 } drm_crtc;
 
-typedef struct {
+struct drm_ctx {
+  /* Our dup of the client's fd, sharing its open file description */
   int fd;
+  dev_t dev;
+
+  /* The client's new open file description, to switch to */
+  atomic_int pending_fd;
 
   drm_crtc crtcs[DRM_MAX_CRTCS];
   int num_crtcs;
@@ -166,924 +499,3068 @@ typedef struct {
   drmModePlaneResPtr pres;
   drmModeRes *res;
 
+  drm_plane_info *planes;
+  uint32_t num_planes;
+  int catalog_atomic;
+  pthread_mutex_t mutex;
+
+  char *cache_file;
+  char *backend_cache_file;
+  drm_cache_key cache_key;
+
   int prefer_afbc_modifier;
   int allow_overlay;
   int num_surfaces;
+  const drm_backend *backend;
+  uint32_t fb_cache_budget;
+  uint32_t surface_pool_size;
   int inited;
   int atomic;
+  int atomic_failures;
+
+  /**
+   * CRTC modes are cached until the generation changed, by DRM uevents or
+   * the client's modesets. Always refetched without the uevent socket.
+   */
+  int uevent_fd;
+  atomic_uint mode_gen;
+
+  /* Loops draining the uevent socket, drained by the callers without */
+  atomic_int uevent_loops;
   int hide;
   uint64_t min_interval;
 
+  /* Set-cursor returns without waiting for the thread */
+  int async_set;
+
+  /**
+   * Prepare active CRTCs on the first modeset or cursor call, cleared once
+   * any prepared
+   */
+  atomic_int prewarm;
+
+  /* Serve all CRTCs in a single loop */
+  int single_thread;
+  drm_loop *loop;
+
+  /* Commit all CRTCs' updates of the single loop together */
+  int batch_commits;
+
+  int flip_pacing;
+  uint64_t latch_margin;
+  int edge_clip;
+  int direct_scanout;
+  int hw_scale;
+
   float scale_x, scale_y;
   float scale_from;
 
   char *configs;
-} drm_ctx;
+};
 
-static drm_ctx g_drm_ctx = { 0, };
+/**
+ * Client fd number to ctx, checked against reusing when setting cursors.
+ * Packed with the ctx's index into one word, published under g_drm_mutex
+ * and looked up lock-free.
+ */
+#define DRM_FD_ENTRY(fd, idx) ((uint64_t)(uint32_t)(fd) << 32 | ((idx) + 1))
+#define DRM_FD_ENTRY_FD(entry) ((int)((entry) >> 32))
+#define DRM_FD_ENTRY_IDX(entry) ((int)((entry) & 0xffffffff) - 1)
+
+/* Ctxs of DRM devices, kept even if failed to init */
+static drm_ctx *g_drm_ctxs[DRM_MAX_DEVICES];
+static _Atomic uint64_t g_drm_fds[DRM_MAX_FDS];
+static int g_drm_next_fd;
+static pthread_mutex_t g_drm_mutex = PTHREAD_MUTEX_INITIALIZER;
 drm_private int g_drm_debug = 0;
 drm_private FILE *g_log_fp = NULL;
 
 static inline uint64_t drm_curr_time(void)
 {
-  struct timeval tv;
+  struct timespec ts;
 
-  gettimeofday(&tv, NULL);
-  return tv.tv_sec + tv.tv_usec / 1000;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
 }
 
-static int drm_plane_get_prop(drm_ctx *ctx, drm_plane *plane, drm_plane_prop p)
+static uint32_t drm_plane_get_prop(drm_plane *plane, drm_plane_prop p)
 {
-  drmModePropertyPtr prop;
-  uint32_t i;
+  return plane->info->props[p].prop_id;
+}
 
-  if (plane->prop_ids[p])
-    return plane->prop_ids[p];
+static int drm_plane_init_commit(drm_plane *plane)
+{
+  int p;
 
-  for (i = 0; i < plane->props->count_props; i++) {
-    prop = drmModeGetProperty(ctx->fd, plane->props->props[i]);
-    if (prop && !strcmp(prop->name, drm_plane_prop_names[p])) {
-      drmModeFreeProperty(prop);
-      plane->prop_ids[p] = i;
-      return i;
-    }
-    drmModeFreeProperty(prop);
+  for (p = PLANE_PROP_CRTC_ID; p <= PLANE_PROP_CRTC_H; p++) {
+    if (!drm_plane_get_prop(plane, p))
+      return -1;
   }
 
-  return -1;
+  plane->req = drmModeAtomicAlloc();
+  if (!plane->req)
+    return -1;
+
+  plane->committed = 0;
+  return 0;
 }
 
-static int drm_atomic_add_plane_prop(drm_ctx *ctx, drmModeAtomicReq *request,
-                                     drm_plane *plane, drm_plane_prop p,
-                                     uint64_t value)
+static void drm_crtc_release_flip(drm_crtc *crtc)
 {
-  int prop_idx = drm_plane_get_prop(ctx, plane, p);
-  if (prop_idx < 0)
-    return -1;
+  if (crtc->flip_fence < 0)
+    return;
 
-  return drmModeAtomicAddProperty(request, plane->plane_id,
-                                  plane->props->props[prop_idx], value);
+  epoll_ctl(crtc->loop->epoll_fd, EPOLL_CTL_DEL, crtc->flip_fence, NULL);
+  close(crtc->flip_fence);
+  crtc->flip_fence = -1;
 }
 
-static int drm_set_plane(drm_ctx *ctx, drm_crtc *crtc, drm_plane *plane,
-                         uint32_t fb, int x, int y, int w, int h)
+static void drm_crtc_track_flip(drm_ctx *ctx, drm_crtc *crtc)
 {
-  drmModeAtomicReq *req;
-  int ret = 0;
+  struct epoll_event event = {
+    .events = EPOLLIN,
+    .data.u64 = LOOP_EVENT(LOOP_EVENT_FLIP, crtc - ctx->crtcs),
+  };
 
-  if (plane->cursor_plane || crtc->async_commit || !ctx->atomic)
-    goto legacy;
+  if (crtc->out_fence < 0)
+    return;
 
-  req = drmModeAtomicAlloc();
-  if (!req)
-    goto legacy;
+  drm_crtc_release_flip(crtc);
 
-  if (!fb) {
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_ID, 0);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_FB_ID, 0);
-  } else {
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane,
-                                     PLANE_PROP_CRTC_ID, crtc->crtc_id);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_FB_ID, fb);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_SRC_X, 0);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_SRC_Y, 0);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane,
-                                     PLANE_PROP_SRC_W, w << 16);
-    ret |= drm_atomic_add_plane_prop(ctx, req,
-                                     plane, PLANE_PROP_SRC_H, h << 16);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_X, x);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_Y, y);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_W, w);
-    ret |= drm_atomic_add_plane_prop(ctx, req, plane, PLANE_PROP_CRTC_H, h);
-  }
-
-  ret |= drmModeAtomicCommit(ctx->fd, req, DRM_MODE_ATOMIC_NONBLOCK, NULL);
-  drmModeAtomicFree(req);
+  /* The fence signals when the commit is on screen */
+  if (epoll_ctl(crtc->loop->epoll_fd, EPOLL_CTL_ADD,
+                crtc->out_fence, &event) < 0) {
+    close(crtc->out_fence);
+    return;
+  }
 
-  if (ret >= 0)
-    return 0;
+  crtc->flip_fence = crtc->out_fence;
+  crtc->flip_time = drm_curr_time();
+}
 
-legacy:
-  if (ret < 0 && ctx->atomic) {
-    DRM_ERROR("CRTC[%d]: failed to do atomic commit (%d)\n",
-              crtc->crtc_id, errno);
-    ctx->atomic = 0;
-  }
-  return drmModeSetPlane(ctx->fd, plane->plane_id, crtc->crtc_id, fb, 0,
-                         x, y, w, h, 0, 0, w << 16, h << 16);
+static void drm_crtc_release_render_fence(drm_crtc *crtc)
+{
+  if (crtc->render_fence >= 0)
+    close(crtc->render_fence);
+
+  crtc->render_fence = -1;
+  crtc->render_fence_fb = 0;
 }
 
-static int drm_plane_get_prop_value(drm_ctx *ctx, drm_plane *plane,
-                                    drm_plane_prop p, uint64_t *value)
+/**
+ * The real libdrm API, for our own commits bypassing the hook below.
+ * Resolved once, they are on the hot path.
+ */
+static int (*g_drm_atomic_commit)(int, drmModeAtomicReqPtr, uint32_t, void *);
+
+static int drm_real_atomic_commit(int fd, drmModeAtomicReqPtr req,
+                                  uint32_t flags, void *user_data)
 {
-  int prop_idx = drm_plane_get_prop(ctx, plane, p);
-  if (prop_idx < 0)
+  if (!g_drm_atomic_commit)
+    *(void **)&g_drm_atomic_commit = dlsym(RTLD_NEXT, "drmModeAtomicCommit");
+  if (!g_drm_atomic_commit) {
+    errno = ENOSYS;
     return -1;
+  }
 
-  *value = plane->props->prop_values[prop_idx];
-  return 0;
+  return g_drm_atomic_commit(fd, req, flags, user_data);
 }
 
-static int drm_plane_set_prop_max(drm_ctx *ctx, drm_plane *plane,
-                                  drm_plane_prop p)
+static void drm_plane_committed(drm_ctx *ctx, drm_crtc *crtc,
+                                drm_plane *plane, uint32_t fb,
+                                const uint64_t *values, int fenced)
 {
-  drmModePropertyPtr prop;
-  int prop_idx = drm_plane_get_prop(ctx, plane, p);
-  if (prop_idx < 0)
-    return -1;
+  if (fenced)
+    drm_crtc_track_flip(ctx, crtc);
 
-  prop = drmModeGetProperty(ctx->fd, plane->props->props[prop_idx]);
-  drmModeObjectSetProperty (ctx->fd, plane->plane_id,
-                            DRM_MODE_OBJECT_PLANE,
-                            plane->props->props[prop_idx],
-                            prop->values[prop->count_values - 1]);
-  DRM_DEBUG("set plane %d prop: %s to max: %"PRIu64"\n",
-            plane->plane_id, drm_plane_prop_names[p],
-            prop->values[prop->count_values - 1]);
-  drmModeFreeProperty(prop);
-  return 0;
+  if (fb == crtc->render_fence_fb)
+    drm_crtc_release_render_fence(crtc);
+
+  /* Disabling might reset the other props */
+  memcpy(plane->commit_values, values, sizeof(plane->commit_values));
+  plane->committed = !!fb;
 }
 
-static void drm_free_plane(drm_plane *plane)
+/* Keep the built request for committing later */
+static void drm_plane_defer_update(drm_plane *plane, uint32_t fb,
+                                   int src_x, int src_y, int src_w, int src_h,
+                                   int x, int y, int w, int h,
+                                   const uint64_t *values, int fenced)
 {
-  drmModeFreeObjectProperties(plane->props);
-  drmModeFreePlane(plane->plane);
-  free(plane);
+  drm_plane_update *update = &plane->batch;
+
+  update->fb = fb;
+  update->src_x = src_x;
+  update->src_y = src_y;
+  update->src_w = src_w;
+  update->src_h = src_h;
+  update->x = x;
+  update->y = y;
+  update->w = w;
+  update->h = h;
+  update->fenced = fenced;
+  memcpy(update->values, values, sizeof(update->values));
+  plane->batched = 1;
 }
 
-static void drm_plane_update_format(drm_ctx *ctx, drm_plane *plane)
+static int drm_set_plane(drm_ctx *ctx, drm_crtc *crtc, drm_plane *plane,
+                         uint32_t fb, int src_x, int src_y, int src_w,
+                         int src_h, int x, int y, int w, int h)
 {
-  drmModePropertyBlobPtr blob;
-  struct drm_format_modifier_blob *header;
-  struct drm_format_modifier *modifiers;
-  uint32_t *formats;
-  uint64_t value;
-  uint32_t i, j;
+  drmModeAtomicReq *req = plane->req;
+  uint64_t values[PLANE_PROP_MAX] = { 0, };
+  int p, last, fenced = 0;
+  int ret = 0;
 
-  plane->can_afbc = plane->can_linear = 0;
+  /* Supersede the deferred update */
+  plane->batched = 0;
 
-  /* Check formats */
-  for (i = 0; i < plane->plane->count_formats; i++) {
-    if (plane->plane->formats[i] == DRM_FORMAT_ARGB8888)
-      break;
+  if (plane->cursor_plane || crtc->async_commit || !ctx->atomic || !req)
+    goto legacy;
+
+  if (fb) {
+    values[PLANE_PROP_CRTC_ID] = crtc->crtc_id;
+    values[PLANE_PROP_FB_ID] = fb;
+    values[PLANE_PROP_SRC_X] = src_x << 16;
+    values[PLANE_PROP_SRC_Y] = src_y << 16;
+    values[PLANE_PROP_SRC_W] = src_w << 16;
+    values[PLANE_PROP_SRC_H] = src_h << 16;
+    values[PLANE_PROP_CRTC_X] = x;
+    values[PLANE_PROP_CRTC_Y] = y;
+    values[PLANE_PROP_CRTC_W] = w;
+    values[PLANE_PROP_CRTC_H] = h;
+    last = PLANE_PROP_CRTC_H;
+  } else {
+    last = PLANE_PROP_FB_ID;
   }
-  if (i == plane->plane->count_formats)
-    return;
 
-  if (drm_plane_get_prop_value(ctx, plane, PLANE_PROP_IN_FORMATS, &value) < 0) {
-    /* No in_formats */
-    plane->can_linear = 1;
-    return;
+  /* Reuse the request, adding only the props changed since last commit */
+  drmModeAtomicSetCursor(req, 0);
+  for (p = PLANE_PROP_CRTC_ID; p <= last; p++) {
+    if (plane->committed && plane->commit_values[p] == values[p])
+      continue;
+
+    if (drmModeAtomicAddProperty(req, plane->plane_id,
+                                 drm_plane_get_prop(plane, p), values[p]) < 0)
+      ret = -1;
   }
 
-  blob = drmModeGetPropertyBlob(ctx->fd, value);
-  if (!blob)
-    return;
+  /* Nothing changed */
+  if (!ret && !drmModeAtomicGetCursor(req))
+    return 0;
 
-  header = blob->data;
-  formats = (uint32_t *) ((char *) header + header->formats_offset);
-  modifiers = (struct drm_format_modifier *)
-    ((char *) header + header->modifiers_offset);
+  /* Let the display wait for the rendering */
+  if (fb && fb == crtc->render_fence_fb && crtc->render_fence >= 0 &&
+      drm_plane_get_prop(plane, PLANE_PROP_IN_FENCE_FD)) {
+    if (drmModeAtomicAddProperty(req, plane->plane_id,
+                                 drm_plane_get_prop(plane,
+                                                    PLANE_PROP_IN_FENCE_FD),
+                                 crtc->render_fence) < 0)
+      ret = -1;
+  }
 
-  /* Check in_formats */
-  for (i = 0; i < header->count_formats; i++) {
-    if (formats[i] == DRM_FORMAT_ARGB8888)
-      break;
+  if (fb && crtc->flip_pacing) {
+    crtc->out_fence = -1;
+    if (drmModeAtomicAddProperty(req, crtc->crtc_id, crtc->out_fence_prop,
+                                 (uintptr_t)&crtc->out_fence) < 0)
+      ret = -1;
+    fenced = 1;
   }
-  if (i == header->count_formats)
-    goto out;
 
-  if (!header->count_modifiers) {
-    plane->can_linear = 1;
-    goto out;
+  /* Committed later with the other CRTCs' updates */
+  if (!ret && crtc->batching) {
+    drm_plane_defer_update(plane, fb, src_x, src_y, src_w, src_h,
+                           x, y, w, h, values, fenced);
+    return 0;
   }
 
-  /* Check modifiers */
-  for (j = 0; j < header->count_modifiers; j++) {
-    struct drm_format_modifier *mod = &modifiers[j];
+  if (!ret) {
+    ret = drm_real_atomic_commit(ctx->fd, req, DRM_MODE_ATOMIC_NONBLOCK,
+                                 NULL);
+
+    /* The previous commit is still pending, hold this one back */
+    if (ret < 0 && DRM_COMMIT_TRANSIENT(errno)) {
+      DRM_DEBUG("CRTC[%d]: commit busy (%d), retry later\n",
+                crtc->crtc_id, errno);
+      drm_plane_defer_update(plane, fb, src_x, src_y, src_w, src_h,
+                             x, y, w, h, values, fenced);
+      crtc->commit_retry_time = drm_curr_time() + DRM_COMMIT_RETRY_TIME;
+      return 0;
+    }
+  }
 
-    if ((i < mod->offset) || (i > mod->offset + 63))
-      continue;
-    if (!(mod->formats & (1 << (i - mod->offset))))
-      continue;
+  if (ret >= 0) {
+    ctx->atomic_failures = 0;
+    drm_plane_committed(ctx, crtc, plane, fb, values, fenced);
+    return 0;
+  }
 
-    if (mod->modifier == DRM_AFBC_MODIFIER)
-      plane->can_afbc = 1;
+  plane->committed = 0;
 
-    if (mod->modifier == DRM_FORMAT_MOD_LINEAR)
-      plane->can_linear = 1;
+  if (fenced) {
+    DRM_INFO("CRTC[%d]: flip pacing unavailable (%d), using max fps\n",
+             crtc->crtc_id, errno);
+    crtc->flip_pacing = 0;
+    return drm_set_plane(ctx, crtc, plane, fb, src_x, src_y, src_w, src_h,
+                         x, y, w, h);
   }
 
-out:
-  drmModeFreePropertyBlob(blob);
+legacy:
+  /* Implicitly synced */
+  drm_crtc_release_render_fence(crtc);
+
+  if (ret < 0 && ctx->atomic) {
+    DRM_ERROR("CRTC[%d]: failed to do atomic commit (%d)\n",
+              crtc->crtc_id, errno);
+
+    /* Only give up atomic for repeated real failures */
+    if (++ctx->atomic_failures >= DRM_MAX_ATOMIC_FAILURES) {
+      DRM_INFO("disabling atomic commits\n");
+      ctx->atomic = 0;
+    }
+  }
+  plane->committed = 0;
+  return drmModeSetPlane(ctx->fd, plane->plane_id, crtc->crtc_id, fb, 0,
+                         x, y, w, h, src_x << 16, src_y << 16,
+                         src_w << 16, src_h << 16);
 }
 
-static drm_plane *drm_get_plane(drm_ctx *ctx, uint32_t plane_id)
+/* Check whether the plane accepts the FB at the placement */
+static int drm_crtc_test_plane(drm_ctx *ctx, drm_crtc *crtc, uint32_t fb,
+                               int src_x, int src_y, int src_w, int src_h,
+                               int x, int y, int w, int h)
 {
-  drm_plane *plane = calloc(1, sizeof(*plane));
-  if (!plane)
-    return NULL;
+  drm_plane *plane = crtc->plane;
+  drmModeAtomicReq *req;
+  uint64_t values[PLANE_PROP_MAX] = { 0, };
+  int p, ret = 0;
 
-  plane->plane_id = plane_id;
-  plane->plane = drmModeGetPlane(ctx->fd, plane_id);
-  if (!plane->plane)
-    goto err;
+  /* TEST_ONLY needs atomic commits */
+  if (plane->cursor_plane || crtc->async_commit || !ctx->atomic ||
+      !plane->req)
+    return 0;
 
-  plane->props = drmModeObjectGetProperties(ctx->fd, plane_id,
-                                            DRM_MODE_OBJECT_PLANE);
-  if (!plane->props)
-    goto err;
+  values[PLANE_PROP_CRTC_ID] = crtc->crtc_id;
+  values[PLANE_PROP_FB_ID] = fb;
+  values[PLANE_PROP_SRC_X] = src_x << 16;
+  values[PLANE_PROP_SRC_Y] = src_y << 16;
+  values[PLANE_PROP_SRC_W] = src_w << 16;
+  values[PLANE_PROP_SRC_H] = src_h << 16;
+  values[PLANE_PROP_CRTC_X] = x;
+  values[PLANE_PROP_CRTC_Y] = y;
+  values[PLANE_PROP_CRTC_W] = w;
+  values[PLANE_PROP_CRTC_H] = h;
 
-  drm_plane_update_format(ctx, plane);
-  return plane;
-err:
-  drm_free_plane(plane);
-  return NULL;
+  req = drmModeAtomicAlloc();
+  if (!req)
+    return 0;
+
+  for (p = PLANE_PROP_CRTC_ID; p <= PLANE_PROP_CRTC_H; p++) {
+    if (drmModeAtomicAddProperty(req, plane->plane_id,
+                                 drm_plane_get_prop(plane, p), values[p]) < 0)
+      break;
+  }
+
+  if (p > PLANE_PROP_CRTC_H)
+    ret = !drm_real_atomic_commit(ctx->fd, req, DRM_MODE_ATOMIC_TEST_ONLY,
+                                  NULL);
+
+  drmModeAtomicFree(req);
+  return ret;
 }
 
-static void drm_load_configs(drm_ctx *ctx)
+/* Check whether the plane accepts cropped placement at the screen edge */
+static int drm_crtc_probe_clip(drm_ctx *ctx, drm_crtc *crtc, uint32_t fb,
+                               int w, int h)
 {
-  struct stat st;
-  const char *file = DRM_CURSOR_CONFIG_FILE;
-  char *ptr, *tmp;
-  int fd;
+  int ret = 0;
 
-  if (stat(file, &st) < 0)
-    return;
+  /* Like the cursor's bottom-right quarter at the top-left corner */
+  if (w >= 2 && h >= 2)
+    ret = drm_crtc_test_plane(ctx, crtc, fb, w / 2, h / 2,
+                              w - w / 2, h - h / 2, 0, 0,
+                              w - w / 2, h - h / 2);
 
-  fd = open(file, O_RDONLY);
+  DRM_INFO("CRTC[%d]: edge clipping by %s\n", crtc->crtc_id,
+           ret ? "plane SRC rect" : "re-rendering");
+  return ret;
+}
+
+/* Scaling the cursor by the plane: 1 supported, 0 not, -1 unknown */
+static int drm_crtc_get_hw_scale(drm_ctx *ctx, drm_crtc *crtc,
+                                 drm_cursor_state *cursor_state)
+{
+  if (!ctx->hw_scale)
+    return 0;
+
+  if (crtc->hw_scale_src_w == cursor_state->width &&
+      crtc->hw_scale_src_h == cursor_state->height &&
+      crtc->hw_scale_dst_w == cursor_state->scaled_w &&
+      crtc->hw_scale_dst_h == cursor_state->scaled_h)
+    return crtc->hw_scale;
+
+  return -1;
+}
+
+/* Check whether the plane scales the FB to the cursor's scaled size */
+static int drm_crtc_probe_hw_scale(drm_ctx *ctx, drm_crtc *crtc, uint32_t fb,
+                                   drm_cursor_state *cursor_state)
+{
+  int src_w = cursor_state->width;
+  int src_h = cursor_state->height;
+  int dst_w = cursor_state->scaled_w;
+  int dst_h = cursor_state->scaled_h;
+
+  crtc->hw_scale_src_w = src_w;
+  crtc->hw_scale_src_h = src_h;
+  crtc->hw_scale_dst_w = dst_w;
+  crtc->hw_scale_dst_h = dst_h;
+
+  crtc->hw_scale = drm_crtc_test_plane(ctx, crtc, fb, 0, 0, src_w, src_h,
+                                       0, 0, dst_w, dst_h);
+
+  DRM_INFO("CRTC[%d]: scaling (%dx%d) to (%dx%d) by %s\n", crtc->crtc_id,
+           src_w, src_h, dst_w, dst_h, crtc->hw_scale ? "plane" : "rendering");
+  return crtc->hw_scale;
+}
+
+/* Wrap the client's BO into a FB, which holds the BO until removed */
+static uint32_t drm_crtc_add_direct_fb(drm_ctx *ctx, drm_crtc *crtc,
+                                       drm_cursor_state *cursor_state)
+{
+  uint32_t handles[4] = { cursor_state->handle, };
+  uint32_t pitches[4] = { cursor_state->width * 4, };
+  uint32_t offsets[4] = { 0, };
+  uint32_t fb;
+
+  if (drmModeAddFB2(ctx->fd, cursor_state->width, cursor_state->height,
+                    DRM_FORMAT_ARGB8888, handles, pitches, offsets,
+                    &fb, 0) < 0) {
+    DRM_INFO("CRTC[%d]: direct scanout unavailable (%d)\n",
+             crtc->crtc_id, errno);
+    crtc->direct_scanout = 0;
+    return 0;
+  }
+
+  if (crtc->direct_scanout < 0) {
+    crtc->direct_scanout =
+      drm_crtc_test_plane(ctx, crtc, fb, 0, 0,
+                          cursor_state->width, cursor_state->height, 0, 0,
+                          cursor_state->width, cursor_state->height);
+
+    DRM_INFO("CRTC[%d]: direct scanout %s\n", crtc->crtc_id,
+             crtc->direct_scanout ? "enabled" : "unavailable");
+
+    if (!crtc->direct_scanout) {
+      drmModeRmFB(ctx->fd, fb);
+      return 0;
+    }
+  }
+
+  return fb;
+}
+
+static int drm_plane_get_prop_value(drm_plane *plane, drm_plane_prop p,
+                                    uint64_t *value)
+{
+  if (!drm_plane_get_prop(plane, p))
+    return -1;
+
+  *value = plane->info->props[p].value;
+  return 0;
+}
+
+static int drm_plane_set_prop_max(drm_ctx *ctx, drm_plane *plane,
+                                  drm_plane_prop p)
+{
+  drm_prop_info *prop = &plane->info->props[p];
+  if (!prop->prop_id)
+    return -1;
+
+  drmModeObjectSetProperty (ctx->fd, plane->plane_id,
+                            DRM_MODE_OBJECT_PLANE, prop->prop_id, prop->max);
+  DRM_DEBUG("set plane %d prop: %s to max: %"PRIu64"\n",
+            plane->plane_id, drm_plane_prop_names[p], prop->max);
+  return 0;
+}
+
+static void drm_free_plane(drm_plane *plane)
+{
+  if (plane->req)
+    drmModeAtomicFree(plane->req);
+
+  free(plane);
+}
+
+/* Property info of the catalog being built, shared by all planes */
+typedef struct {
+  uint32_t prop_id;
+  int p; /* drm_plane_prop, -1 for unused */
+  int immutable;
+  uint64_t min;
+  uint64_t max;
+} drm_prop_entry;
+
+typedef struct {
+  drm_prop_entry *entries;
+  int num_entries;
+} drm_prop_cache;
+
+static drm_prop_entry *drm_catalog_get_prop(drm_ctx *ctx,
+                                            drm_prop_cache *cache,
+                                            uint32_t prop_id)
+{
+  drm_prop_entry *entries, *entry;
+  drmModePropertyPtr prop;
+  int i;
+
+  for (i = 0; i < cache->num_entries; i++) {
+    if (cache->entries[i].prop_id == prop_id)
+      return &cache->entries[i];
+  }
+
+  entries = realloc(cache->entries,
+                    (cache->num_entries + 1) * sizeof(*entries));
+  if (!entries)
+    return NULL;
+
+  cache->entries = entries;
+  entry = &entries[cache->num_entries++];
+  memset(entry, 0, sizeof(*entry));
+  entry->prop_id = prop_id;
+  entry->p = -1;
+
+  /* Only one ioctl for each property of the device */
+  prop = drmModeGetProperty(ctx->fd, prop_id);
+  if (!prop)
+    return entry;
+
+  for (i = 0; i < PLANE_PROP_MAX; i++) {
+    if (!strcmp(prop->name, drm_plane_prop_names[i])) {
+      entry->p = i;
+      break;
+    }
+  }
+
+  entry->immutable = !!(prop->flags & DRM_MODE_PROP_IMMUTABLE);
+
+  if (prop->count_values > 0) {
+    entry->min = prop->values[0];
+    entry->max = prop->values[prop->count_values - 1];
+  }
+
+  drmModeFreeProperty(prop);
+  return entry;
+}
+
+static int drm_catalog_scan_plane(drm_ctx *ctx, drm_prop_cache *cache,
+                                  drm_plane_info *info)
+{
+  drmModeObjectPropertiesPtr props;
+  drm_prop_entry *entry;
+  uint32_t i;
+
+  props = drmModeObjectGetProperties(ctx->fd, info->plane_id,
+                                     DRM_MODE_OBJECT_PLANE);
+  if (!props)
+    return -1;
+
+  for (i = 0; i < props->count_props; i++) {
+    entry = drm_catalog_get_prop(ctx, cache, props->props[i]);
+    if (!entry || entry->p < 0)
+      continue;
+
+    /* Cached across runs, so no current values like zpos */
+    info->props[entry->p].prop_id = entry->prop_id;
+    info->props[entry->p].value =
+      entry->immutable ? props->prop_values[i] : 0;
+    info->props[entry->p].min = entry->min;
+    info->props[entry->p].max = entry->max;
+  }
+
+  drmModeFreeObjectProperties(props);
+  return 0;
+}
+
+static void drm_catalog_update_format(drm_ctx *ctx, drm_plane_info *info,
+                                      drmModePlane *plane)
+{
+  drmModePropertyBlobPtr blob;
+  struct drm_format_modifier_blob *header;
+  struct drm_format_modifier *modifiers;
+  uint32_t *formats;
+  uint64_t value;
+  uint32_t i, j;
+
+  info->can_afbc = info->can_linear = 0;
+
+  /* Check formats */
+  for (i = 0; i < plane->count_formats; i++) {
+    if (plane->formats[i] == DRM_FORMAT_ARGB8888)
+      break;
+  }
+  if (i == plane->count_formats)
+    return;
+
+  if (!info->props[PLANE_PROP_IN_FORMATS].prop_id) {
+    /* No in_formats */
+    info->can_linear = 1;
+    return;
+  }
+
+  value = info->props[PLANE_PROP_IN_FORMATS].value;
+  blob = drmModeGetPropertyBlob(ctx->fd, value);
+  if (!blob)
+    return;
+
+  header = blob->data;
+  formats = (uint32_t *) ((char *) header + header->formats_offset);
+  modifiers = (struct drm_format_modifier *)
+    ((char *) header + header->modifiers_offset);
+
+  /* Check in_formats */
+  for (i = 0; i < header->count_formats; i++) {
+    if (formats[i] == DRM_FORMAT_ARGB8888)
+      break;
+  }
+  if (i == header->count_formats)
+    goto out;
+
+  if (!header->count_modifiers) {
+    info->can_linear = 1;
+    goto out;
+  }
+
+  /* Check modifiers */
+  for (j = 0; j < header->count_modifiers; j++) {
+    struct drm_format_modifier *mod = &modifiers[j];
+
+    if ((i < mod->offset) || (i > mod->offset + 63))
+      continue;
+    if (!(mod->formats & (1ULL << (i - mod->offset))))
+      continue;
+
+    if (mod->modifier == DRM_AFBC_MODIFIER)
+      info->can_afbc = 1;
+
+    if (mod->modifier == DRM_FORMAT_MOD_LINEAR)
+      info->can_linear = 1;
+  }
+
+out:
+  drmModeFreePropertyBlob(blob);
+}
+
+static int drm_cache_init_key(drm_ctx *ctx)
+{
+  drm_cache_key *key = &ctx->cache_key;
+  drmVersionPtr version;
+  struct utsname uts;
+  struct stat st;
+
+  /* Zeroed for comparing with memcmp */
+  memset(key, 0, sizeof(*key));
+
+  if (fstat(ctx->fd, &st) < 0 || uname(&uts) < 0)
+    return -1;
+
+  version = drmGetVersion(ctx->fd);
+  if (!version)
+    return -1;
+
+  key->dev = st.st_rdev;
+  snprintf(key->driver, sizeof(key->driver), "%s", version->name);
+  key->driver_version[0] = version->version_major;
+  key->driver_version[1] = version->version_minor;
+  key->driver_version[2] = version->version_patchlevel;
+  snprintf(key->kernel, sizeof(key->kernel), "%s", uts.release);
+
+  drmFreeVersion(version);
+  return 0;
+}
+
+static int drm_cache_load(drm_ctx *ctx)
+{
+  drm_cache_header *header;
+  drm_plane_info *planes;
+  struct stat st;
+  size_t size;
+  void *ptr;
+  uint32_t i;
+  int fd, ret = -1;
+
+  fd = open(ctx->cache_file, O_RDONLY | O_CLOEXEC);
   if (fd < 0)
+    return -1;
+
+  if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(*header))
+    goto out_close_fd;
+
+  ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (ptr == MAP_FAILED)
+    goto out_close_fd;
+
+  header = ptr;
+  planes = (drm_plane_info *) (header + 1);
+  size = sizeof(*header) + header->num_planes * sizeof(*planes);
+
+  if (header->magic != DRM_CACHE_MAGIC ||
+      header->version != DRM_CACHE_VERSION || (size_t) st.st_size != size ||
+      memcmp(&header->key, &ctx->cache_key, sizeof(ctx->cache_key)))
+    goto out_unmap;
+
+  /* Planes failed to catalog were skipped, match the others by ID */
+  if (header->num_planes > ctx->pres->count_planes)
+    goto out_unmap;
+
+  for (i = 0; i < header->num_planes; i++) {
+    uint32_t j;
+
+    for (j = 0; j < ctx->pres->count_planes; j++) {
+      if (planes[i].plane_id == ctx->pres->planes[j])
+        break;
+    }
+
+    if (j == ctx->pres->count_planes)
+      goto out_unmap;
+  }
+
+  ctx->planes = malloc(header->num_planes * sizeof(*planes));
+  if (!ctx->planes)
+    goto out_unmap;
+
+  memcpy(ctx->planes, planes, header->num_planes * sizeof(*planes));
+  ctx->num_planes = header->num_planes;
+  ctx->catalog_atomic = header->catalog_atomic;
+
+  for (i = 0; i < DRM_MAX_CRTCS; i++) {
+    for (int j = 0; j < ctx->num_crtcs; j++) {
+      drm_crtc *crtc = &ctx->crtcs[j];
+      if (header->crtcs[i].crtc_id &&
+          crtc->crtc_id == header->crtcs[i].crtc_id)
+        crtc->cached_plane_id = header->crtcs[i].plane_id;
+    }
+  }
+
+  ret = 0;
+out_unmap:
+  munmap(ptr, st.st_size);
+out_close_fd:
+  close(fd);
+  return ret;
+}
+
+static void drm_cache_save(drm_ctx *ctx)
+{
+  drm_cache_header header;
+  char path[PATH_MAX];
+  size_t size;
+  int i, fd;
+
+  if (!ctx->cache_file)
     return;
 
-  ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-  if (ptr == MAP_FAILED)
-    goto out_close_fd;
+  memset(&header, 0, sizeof(header));
+  header.magic = DRM_CACHE_MAGIC;
+  header.version = DRM_CACHE_VERSION;
+  header.key = ctx->cache_key;
+
+  pthread_mutex_lock(&ctx->mutex);
+
+  header.catalog_atomic = ctx->catalog_atomic;
+  header.num_planes = ctx->num_planes;
+  for (i = 0; i < ctx->num_crtcs; i++) {
+    drm_crtc *crtc = &ctx->crtcs[i];
+
+    header.crtcs[i].crtc_id = crtc->crtc_id;
+    header.crtcs[i].plane_id = crtc->cached_plane_id;
+  }
+
+  /* Replace the cache atomically */
+  snprintf(path, sizeof(path), "%s.%d", ctx->cache_file, getpid());
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    DRM_DEBUG("failed to create cache: %s\n", path);
+    goto out;
+  }
+
+  size = ctx->num_planes * sizeof(*ctx->planes);
+  if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+      write(fd, ctx->planes, size) != (ssize_t) size) {
+    close(fd);
+    goto err;
+  }
+
+  close(fd);
+  if (rename(path, ctx->cache_file) < 0)
+    goto err;
+
+  DRM_DEBUG("saved cache: %s\n", ctx->cache_file);
+  goto out;
+err:
+  DRM_DEBUG("failed to save cache: %s\n", ctx->cache_file);
+  unlink(path);
+out:
+  pthread_mutex_unlock(&ctx->mutex);
+}
+
+static int drm_catalog_init(drm_ctx *ctx)
+{
+  drm_prop_cache cache = { 0, };
+  drm_plane_info *info;
+  drmModePlane *plane;
+  uint32_t i;
+
+  if (ctx->cache_file && !drm_cache_load(ctx)) {
+    DRM_DEBUG("loaded %d planes from cache: %s\n",
+              ctx->num_planes, ctx->cache_file);
+    return 0;
+  }
+
+  ctx->planes = calloc(ctx->pres->count_planes, sizeof(*ctx->planes));
+  if (!ctx->planes)
+    return -1;
+
+  for (i = 0; i < ctx->pres->count_planes; i++) {
+    plane = drmModeGetPlane(ctx->fd, ctx->pres->planes[i]);
+    if (!plane)
+      continue;
+
+    info = &ctx->planes[ctx->num_planes];
+    info->plane_id = plane->plane_id;
+    info->possible_crtcs = plane->possible_crtcs;
+
+    if (!drm_catalog_scan_plane(ctx, &cache, info)) {
+      drm_catalog_update_format(ctx, info, plane);
+      ctx->num_planes++;
+    }
+
+    drmModeFreePlane(plane);
+  }
+
+  DRM_DEBUG("cataloged %d planes with %d props\n",
+            ctx->num_planes, cache.num_entries);
+
+  free(cache.entries);
+
+  drm_cache_save(ctx);
+  return 0;
+}
+
+/* Catalog the props only exposed with atomic cap enabled */
+static int drm_catalog_update_atomic(drm_ctx *ctx)
+{
+  drm_prop_cache cache = { 0, };
+  uint32_t i;
+  int ret = 0;
+
+  pthread_mutex_lock(&ctx->mutex);
+  if (ctx->catalog_atomic)
+    goto out;
+
+  for (i = 0; i < ctx->num_planes; i++)
+    ret |= drm_catalog_scan_plane(ctx, &cache, &ctx->planes[i]);
+
+  free(cache.entries);
+  ctx->catalog_atomic = !ret;
+  pthread_mutex_unlock(&ctx->mutex);
+
+  if (ctx->catalog_atomic)
+    drm_cache_save(ctx);
+  return ret;
+out:
+  pthread_mutex_unlock(&ctx->mutex);
+  return ret;
+}
+
+static drm_plane *drm_get_plane(drm_ctx *ctx, uint32_t plane_id)
+{
+  drm_plane *plane;
+  uint32_t i;
+
+  for (i = 0; i < ctx->num_planes; i++) {
+    if (ctx->planes[i].plane_id == plane_id)
+      break;
+  }
+  if (i == ctx->num_planes)
+    return NULL;
+
+  plane = calloc(1, sizeof(*plane));
+  if (!plane)
+    return NULL;
+
+  plane->plane_id = plane_id;
+  plane->info = &ctx->planes[i];
+  return plane;
+}
+
+static void drm_load_configs(drm_ctx *ctx)
+{
+  struct stat st;
+  const char *file = DRM_CURSOR_CONFIG_FILE;
+  char *ptr, *tmp;
+  int fd;
+
+  if (stat(file, &st) < 0)
+    return;
+
+  fd = open(file, O_RDONLY);
+  if (fd < 0)
+    return;
+
+  ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (ptr == MAP_FAILED)
+    goto out_close_fd;
+
+  ctx->configs = malloc(st.st_size + 1);
+  if (!ctx->configs)
+    goto out_unmap;
+
+  memcpy(ctx->configs, ptr, st.st_size);
+  ctx->configs[st.st_size] = '\0';
+
+  tmp = ctx->configs;
+  while ((tmp = strchr(tmp, '#'))) {
+    while (*tmp != '\n' && *tmp != '\0')
+      *tmp++ = '\n';
+  }
+
+out_unmap:
+  munmap(ptr, st.st_size);
+out_close_fd:
+  close(fd);
+}
+
+static const char *drm_get_config(drm_ctx *ctx, const char *name)
+{
+  static char buf[4096];
+  const char *config;
+
+  if (!ctx->configs)
+    return NULL;
+
+  config = strstr(ctx->configs, name);
+  if (!config)
+    return NULL;
+
+  if (config[strlen(name)] == '\n' || config[strlen(name)] == '\r')
+    return NULL;
+
+  sscanf(config + strlen(name), "%4095s", buf);
+  return buf;
+}
+
+static int drm_get_config_int(drm_ctx *ctx, const char *name, int def)
+{
+  const char *config = drm_get_config(ctx, name);
+
+  if (config)
+    return atoi(config);
+
+  return def;
+}
+
+/* Kernel uevents, for hotplugs and mode changes */
+static int drm_open_uevent(void)
+{
+  struct sockaddr_nl addr = {
+    .nl_family = AF_NETLINK,
+    .nl_groups = 1,
+  };
+  int fd;
+
+  fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+              NETLINK_KOBJECT_UEVENT);
+  if (fd < 0)
+    return -1;
+
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void drm_handle_uevents(drm_ctx *ctx)
+{
+  char buf[4096], *p;
+  ssize_t len;
+  int changed = 0;
+
+  /* NUL-separated "action@devpath" and "KEY=value"s */
+  while ((len = recv(ctx->uevent_fd, buf, sizeof(buf) - 1, 0)) > 0) {
+    buf[len] = '\0';
+    for (p = buf; p < buf + len; p += strlen(p) + 1) {
+      if (!strcmp(p, "SUBSYSTEM=drm"))
+        changed = 1;
+    }
+  }
+
+  if (changed) {
+    DRM_DEBUG("DRM uevent, refetch CRTC modes\n");
+    atomic_fetch_add(&ctx->mode_gen, 1);
+  }
+}
+
+static int drm_init_ctx(drm_ctx *ctx, int fd)
+{
+  uint32_t prefer_planes[DRM_MAX_CRTCS] = { 0, };
+  uint32_t prefer_plane = 0;
+  uint32_t i, max_fps, count_crtcs;
+  const char *config;
+
+  ctx->fd = dup(fd);
+  if (ctx->fd < 0)
+    return -1;
+
+  drm_load_configs(ctx);
+
+  g_drm_debug = drm_get_config_int(ctx, OPT_DEBUG, 0);
+
+  if (getenv("DRM_DEBUG") || !access("/tmp/.drm_cursor_debug", F_OK))
+    g_drm_debug = 1;
+
+  if (!(config = getenv("DRM_CURSOR_LOG_FILE")))
+    config = drm_get_config(ctx, OPT_LOG_FILE);
+
+  /* Shared by all devices */
+  if (!g_log_fp)
+    g_log_fp = fopen(config ? config : "/var/log/drm-cursor.log", "wb+");
+
+  ctx->atomic = drm_get_config_int(ctx, OPT_ATOMIC, 1);
+  DRM_INFO("atomic drm API %s\n", ctx->atomic ? "enabled" : "disabled");
+
+  ctx->hide = drm_get_config_int(ctx, OPT_HIDE, 0);
+  if (ctx->hide)
+    DRM_INFO("invisible cursors\n");
+
+  ctx->async_set = drm_get_config_int(ctx, OPT_ASYNC_SET, 0);
+  if (ctx->async_set)
+    DRM_INFO("setting cursors asynchronously\n");
+
+  atomic_store(&ctx->prewarm, drm_get_config_int(ctx, OPT_PREWARM, 0));
+
+#ifdef PREFER_AFBC_MODIFIER
+  ctx->prefer_afbc_modifier = 1;
+#endif
+
+  ctx->prefer_afbc_modifier =
+    drm_get_config_int(ctx, OPT_PREFER_AFBC, ctx->prefer_afbc_modifier);
+
+  if (ctx->prefer_afbc_modifier)
+    DRM_DEBUG("prefer ARM AFBC modifier\n");
+
+  ctx->allow_overlay = drm_get_config_int(ctx, OPT_ALLOW_OVERLAY, 0);
+
+  if (ctx->allow_overlay)
+    DRM_DEBUG("allow overlay planes\n");
+
+  drmSetClientCap(ctx->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+
+  ctx->num_surfaces = drm_get_config_int(ctx, OPT_NUM_SURFACES, 8);
+
+  config = drm_get_config(ctx, OPT_BACKEND);
+  if (config && !strcmp(config, cpu_backend.name))
+    ctx->backend = &cpu_backend;
+  else
+    ctx->backend = &egl_backend;
+  DRM_INFO("using %s backend\n", ctx->backend->name);
+
+  ctx->edge_clip = drm_get_config_int(ctx, OPT_EDGE_CLIP, 1);
+  DRM_DEBUG("edge clipping by plane %s\n",
+            ctx->edge_clip ? "SRC rect" : "re-rendering");
+
+  ctx->direct_scanout = drm_get_config_int(ctx, OPT_DIRECT_SCANOUT, 1);
+  DRM_DEBUG("direct scanout %s\n",
+            ctx->direct_scanout ? "enabled" : "disabled");
+
+  ctx->hw_scale = drm_get_config_int(ctx, OPT_PLANE_SCALING, 1);
+  DRM_DEBUG("scaling by plane %s\n", ctx->hw_scale ? "enabled" : "disabled");
+
+  ctx->fb_cache_budget = drm_get_config_int(ctx, OPT_FB_CACHE_KB, 1024) * 1024;
+  DRM_DEBUG("FB cache budget: %dKB\n", ctx->fb_cache_budget / 1024);
+
+  /* Fit the buckets up to 256x256, each holding num-surfaces surfaces */
+  ctx->surface_pool_size =
+    drm_get_config_int(ctx, OPT_SURFACE_POOL_KB,
+                       512 * ctx->num_surfaces) * 1024;
+  DRM_DEBUG("surface pool budget: %dKB\n", ctx->surface_pool_size / 1024);
+
+  max_fps = drm_get_config_int(ctx, OPT_MAX_FPS, 0);
+  if (max_fps <= 0)
+    max_fps = 60;
+
+  ctx->min_interval = NSEC_PER_SEC / max_fps;
+
+  DRM_INFO("max fps: %d\n", max_fps);
+
+  ctx->flip_pacing = drm_get_config_int(ctx, OPT_FLIP_PACING, 1);
+  if (ctx->flip_pacing)
+    DRM_INFO("pacing commits by flip completion\n");
+
+  ctx->latch_margin = drm_get_config_int(ctx, OPT_LATCH_MARGIN_US, 0);
+  if (ctx->latch_margin) {
+    DRM_INFO("late latching %"PRIu64"us before vblank\n", ctx->latch_margin);
+    ctx->latch_margin *= NSEC_PER_USEC;
+  }
+
+  ctx->single_thread = drm_get_config_int(ctx, OPT_SINGLE_THREAD, 0);
+  if (ctx->single_thread)
+    DRM_INFO("serving all CRTCs in a single thread\n");
+
+  ctx->batch_commits =
+    ctx->single_thread && drm_get_config_int(ctx, OPT_BATCH_COMMITS, 0);
+  if (ctx->batch_commits)
+    DRM_INFO("batching commits of all CRTCs\n");
+
+  ctx->uevent_fd = -1;
+  if (drm_get_config_int(ctx, OPT_UEVENT_MODES, 1)) {
+    ctx->uevent_fd = drm_open_uevent();
+    if (ctx->uevent_fd < 0)
+      DRM_INFO("uevents unavailable (%d), not caching modes\n", errno);
+  }
+  atomic_store(&ctx->mode_gen, 1);
+
+  config = drm_get_config(ctx, OPT_SCALE_FROM);
+  if (config) {
+    int w, h, screen_w, screen_h;
+    if (config &&
+        sscanf(config, "%dx%d/%dx%d", &w, &h, &screen_w, &screen_h) == 4) {
+      ctx->scale_from = 1.0 * w * h / screen_w / screen_h;
+      DRM_INFO("scale from: %s\n", config);
+    }
+  } else {
+    config = drm_get_config(ctx, OPT_SCALE);
+    if (config && sscanf(config, "%fx%f", &ctx->scale_x, &ctx->scale_y) == 2)
+      DRM_INFO("scale: %s\n", config);
+  }
+
+  ctx->res = drmModeGetResources(ctx->fd);
+  if (!ctx->res)
+    goto err_free_configs;
+
+  ctx->pres = drmModeGetPlaneResources(ctx->fd);
+  if (!ctx->pres)
+    goto err_free_res;
+
+  pthread_mutex_init(&ctx->mutex, NULL);
+
+  count_crtcs = ctx->res->count_crtcs;
+
+  /* Allow specifying prefer plane */
+  if ((config = getenv("DRM_CURSOR_PREFER_PLANE")))
+    prefer_plane = atoi(config);
+  else
+    prefer_plane = drm_get_config_int(ctx, OPT_PREFER_PLANE, 0);
+
+  /* Allow specifying prefer planes */
+  if (!(config = getenv("DRM_CURSOR_PREFER_PLANES")))
+    config = drm_get_config(ctx, OPT_PREFER_PLANES);
+  for (i = 0; config && i < count_crtcs; i++) {
+    prefer_planes[i] = atoi(config);
+
+    config = strchr(config, ',');
+    if (config)
+      config++;
+  }
+
+  /* Fetch all CRTCs */
+  for (i = 0; i < count_crtcs; i++) {
+    drmModeCrtcPtr c = drmModeGetCrtc(ctx->fd, ctx->res->crtcs[i]);
+    drm_crtc *crtc = &ctx->crtcs[ctx->num_crtcs];
+
+    if (!c)
+      continue;
+
+    crtc->crtc_id = c->crtc_id;
+    crtc->crtc_pipe = i;
+    crtc->event_fd = -1;
+    crtc->flip_fence = -1;
+    crtc->render_fence = -1;
+    crtc->prefer_plane_id = prefer_planes[i] ? prefer_planes[i] : prefer_plane;
+
+    DRM_DEBUG("found %d CRTC: %d(%d) (%dx%d) prefer plane: %d\n",
+              ctx->num_crtcs, c->crtc_id, i, c->width, c->height,
+              crtc->prefer_plane_id);
+
+    ctx->num_crtcs++;
+    drmModeFreeCrtc(c);
+  }
+
+  DRM_DEBUG("found %d CRTCs\n", ctx->num_crtcs);
+
+  if (!ctx->num_crtcs)
+    goto err_free_pres;
+
+  if (drm_get_config_int(ctx, OPT_CACHE, 1) && !drm_cache_init_key(ctx)) {
+    config = drm_get_config(ctx, OPT_CACHE_FILE);
+    if (config) {
+      ctx->cache_file = strdup(config);
+    } else {
+      char path[PATH_MAX];
+
+      /* One cache for each device */
+      snprintf(path, sizeof(path), "/run/drm-cursor-%d-%d.cache",
+               major(ctx->cache_key.dev), minor(ctx->cache_key.dev));
+      ctx->cache_file = strdup(path);
+    }
+
+    if (ctx->cache_file) {
+      char path[PATH_MAX];
+
+      /* Backends' states, e.g. linked shader programs */
+      snprintf(path, sizeof(path), "%s.%s", ctx->cache_file,
+               ctx->backend->name);
+      ctx->backend_cache_file = strdup(path);
+    }
+  }
+
+  if (drm_catalog_init(ctx) < 0)
+    goto err_free_pres;
+
+  config = drm_get_config(ctx, OPT_CRTC_BLOCKLIST);
+  for (i = 0; config && i < count_crtcs; i++) {
+    uint32_t crtc_id = atoi(config);
+
+    for (int j = 0; j < ctx->num_crtcs; j++) {
+      drm_crtc *crtc = &ctx->crtcs[j];
+      if (crtc->crtc_id != crtc_id)
+        continue;
+
+      DRM_DEBUG("CRTC: %d blocked\n", crtc_id);
+      crtc->blocked = 1;
+    }
+
+    config = strchr(config, ',');
+    if (config)
+      config++;
+  }
+
+  if (g_drm_debug) {
+    /* Dump planes for debugging */
+    for (i = 0; i < ctx->num_planes; i++) {
+      drm_plane_info *info = &ctx->planes[i];
+      uint64_t value = info->props[PLANE_PROP_type].value;
+      char *type;
+
+      switch (value) {
+      case DRM_PLANE_TYPE_PRIMARY:
+        type = "primary";
+        break;
+      case DRM_PLANE_TYPE_OVERLAY:
+        type = "overlay";
+        break;
+      case DRM_PLANE_TYPE_CURSOR:
+        type = "cursor ";
+        break;
+      default:
+        type = "unknown";
+        break;
+      }
+
+      DRM_DEBUG("found plane: %d[%s] crtcs: 0x%x %s%s\n",
+                info->plane_id, type, info->possible_crtcs,
+                info->can_linear ? "(ARGB)" : "",
+                info->can_afbc ? "(AFBC)" : "");
+    }
+  }
+
+  DRM_INFO("using libdrm-cursor (%s) on device: %d-%d\n",
+           LIBDRM_CURSOR_VERSION, major(ctx->dev), minor(ctx->dev));
+
+  ctx->inited = 1;
+  return 0;
+
+err_free_pres:
+  free(ctx->cache_file);
+  ctx->cache_file = NULL;
+  free(ctx->backend_cache_file);
+  ctx->backend_cache_file = NULL;
+  free(ctx->planes);
+  ctx->planes = NULL;
+  ctx->num_planes = 0;
+  drmModeFreePlaneResources(ctx->pres);
+err_free_res:
+  drmModeFreeResources(ctx->res);
+err_free_configs:
+  free(ctx->configs);
+  close(ctx->fd);
+  ctx->fd = -1;
+  return -1;
+}
+
+/* Whether the fds share the same open file description */
+static int drm_same_file(int fd1, int fd2)
+{
+  pid_t pid = getpid();
+  int flags, ret;
+
+  ret = syscall(SYS_kcmp, pid, pid, KCMP_FILE, fd1, fd2);
+  if (ret >= 0)
+    return !ret;
+
+  /* No kcmp, toggle the file status flags of one and check the other */
+  flags = fcntl(fd1, F_GETFL, 0);
+  if (flags < 0 || fcntl(fd2, F_GETFL, 0) != flags)
+    return 0;
+
+  fcntl(fd1, F_SETFL, flags ^ O_NONBLOCK);
+  ret = fcntl(fd2, F_GETFL, 0) != flags;
+  fcntl(fd1, F_SETFL, flags);
+  return ret;
+}
+
+/* Find the device's ctx, creating it for new devices */
+static drm_ctx *drm_get_dev_ctx(int fd)
+{
+  drm_ctx *ctx;
+  struct stat st;
+  int i, pending_fd;
+
+  if (fstat(fd, &st) < 0 || !S_ISCHR(st.st_mode))
+    return NULL;
+
+  for (i = 0; i < DRM_MAX_DEVICES && g_drm_ctxs[i]; i++) {
+    ctx = g_drm_ctxs[i];
+    if (ctx->dev != st.st_rdev)
+      continue;
+
+    /* Failed already */
+    if (!ctx->inited)
+      return NULL;
+
+    /**
+     * Follow the client's new open file description of the device, switched
+     * by the caller once the threads stopped using the old one.
+     */
+    pending_fd = atomic_load(&ctx->pending_fd);
+    if (!drm_same_file(fd, ctx->fd) &&
+        (pending_fd < 0 || !drm_same_file(fd, pending_fd))) {
+      DRM_DEBUG("new fd: %d\n", fd);
+      pending_fd = atomic_exchange(&ctx->pending_fd, dup(fd));
+      if (pending_fd >= 0)
+        close(pending_fd);
+    }
+
+    return ctx;
+  }
+
+  if (i == DRM_MAX_DEVICES)
+    return NULL;
+
+  ctx = calloc(1, sizeof(*ctx));
+  if (!ctx)
+    return NULL;
+
+  ctx->dev = st.st_rdev;
+  atomic_init(&ctx->pending_fd, -1);
+  g_drm_ctxs[i] = ctx;
+
+  if (drm_init_ctx(ctx, fd) < 0)
+    return NULL;
+
+  return ctx;
+}
+
+/**
+ * Find the ctx of the client's fd. The fd is identified once and remembered,
+ * and only checked against being reused for another file when check is set.
+ */
+static drm_ctx *drm_fd_lookup(int fd, int check, int *slot)
+{
+  uint64_t entry;
+  drm_ctx *ctx;
+  int i;
+
+  for (i = 0; i < DRM_MAX_FDS; i++) {
+    entry = atomic_load_explicit(&g_drm_fds[i], memory_order_acquire);
+    if (!entry || DRM_FD_ENTRY_FD(entry) != fd)
+      continue;
+
+    if (slot)
+      *slot = i;
+
+    ctx = g_drm_ctxs[DRM_FD_ENTRY_IDX(entry)];
+    if (!check || drm_same_file(fd, ctx->fd))
+      return ctx;
+
+    return NULL;
+  }
+
+  return NULL;
+}
+
+static drm_ctx *drm_get_ctx(int fd, int check)
+{
+  drm_ctx *ctx;
+  int i, slot = -1;
+
+  if (fd < 0)
+    return NULL;
+
+  /* Known fds are looked up without locking, like moving cursors */
+  ctx = drm_fd_lookup(fd, check, NULL);
+  if (ctx)
+    return ctx;
+
+  pthread_mutex_lock(&g_drm_mutex);
+
+  ctx = drm_fd_lookup(fd, check, &slot);
+  if (ctx)
+    goto out;
+
+  ctx = drm_get_dev_ctx(fd);
+  if (!ctx)
+    goto out;
+
+  /* Remember the fd, replacing the oldest one */
+  if (slot < 0) {
+    slot = g_drm_next_fd;
+    g_drm_next_fd = (g_drm_next_fd + 1) % DRM_MAX_FDS;
+  }
+
+  for (i = 0; g_drm_ctxs[i] != ctx; i++);
+
+  atomic_store_explicit(&g_drm_fds[slot], DRM_FD_ENTRY(fd, i),
+                        memory_order_release);
+out:
+  pthread_mutex_unlock(&g_drm_mutex);
+  return ctx;
+}
+
+#define drm_crtc_bind_plane_force(ctx, crtc, plane) \
+  drm_crtc_bind_plane(ctx, crtc, plane, 1)
+
+#define drm_crtc_bind_plane_cursor(ctx, crtc, plane) \
+  drm_crtc_bind_plane(ctx, crtc, plane, 0)
+
+static int drm_crtc_bind_plane(drm_ctx *ctx, drm_crtc *crtc, uint32_t plane_id,
+                               int allow_overlay)
+{
+  drm_plane *plane;
+  uint64_t value;
+  int i;
+
+  /* CRTC already assigned */
+  if (crtc->plane)
+    return 1;
+
+  /* Plane already assigned */
+  for (i = 0; i < ctx->num_crtcs; i++) {
+    if (ctx->crtcs[i].plane && ctx->crtcs[i].plane->plane_id == plane_id)
+      return -1;
+  }
+
+  plane = drm_get_plane(ctx, plane_id);
+  if (!plane)
+    return -1;
+
+  /* Unable to use */
+  if (!plane->info->can_afbc && !plane->info->can_linear)
+    goto err;
+
+  /* Not for this CRTC */
+  if (!(plane->info->possible_crtcs & (1 << crtc->crtc_pipe)))
+    goto err;
+
+  /* Not using primary planes */
+  if (drm_plane_get_prop_value(plane, PLANE_PROP_type, &value) < 0)
+    goto err;
+
+  if (value == DRM_PLANE_TYPE_PRIMARY)
+    goto err;
+
+  /* Check for overlay plane */
+  if (!allow_overlay && value == DRM_PLANE_TYPE_OVERLAY)
+    goto err;
+
+  plane->cursor_plane = value == DRM_PLANE_TYPE_CURSOR;
+  if (plane->cursor_plane)
+    DRM_INFO("CRTC[%d]: using cursor plane\n", crtc->crtc_id);
+
+  if (ctx->prefer_afbc_modifier && plane->info->can_afbc)
+    crtc->use_afbc_modifier = 1;
+  else if (!plane->info->can_linear)
+    crtc->use_afbc_modifier = 1;
+
+  DRM_DEBUG("CRTC[%d]: bind plane: %d%s\n", crtc->crtc_id, plane->plane_id,
+            crtc->use_afbc_modifier ? "(AFBC)" : "");
+
+  crtc->plane = plane;
+
+  return 0;
+err:
+  drm_free_plane(plane);
+  return -1;
+}
+
+static int drm_crtc_valid(drm_crtc *crtc)
+{
+  return (crtc->width > 0 && crtc->height > 0) ? 0 : -1;
+}
+
+static int drm_update_crtc(drm_ctx *ctx, drm_crtc *crtc)
+{
+  unsigned gen = atomic_load(&ctx->mode_gen);
+  drmModeCrtcPtr c;
+  int was_connected, connected;
+
+  /* Catch up the uevents queued before any loop started */
+  if (ctx->uevent_fd >= 0 && !atomic_load(&ctx->uevent_loops)) {
+    drm_handle_uevents(ctx);
+    gen = atomic_load(&ctx->mode_gen);
+  }
+
+  /* Unchanged since last fetched */
+  if (ctx->uevent_fd >= 0 && crtc->mode_gen == gen)
+    return drm_crtc_valid(crtc);
+
+  c = drmModeGetCrtc(ctx->fd, crtc->crtc_id);
+  if (!c)
+    return -1;
+
+  crtc->mode_gen = gen;
+
+  was_connected = drm_crtc_valid(crtc) >= 0;
+  crtc->width = c->width;
+  crtc->height = c->height;
+  connected = drm_crtc_valid(crtc) >= 0;
+
+  drmModeFreeCrtc(c);
+
+  if (connected != was_connected)
+    DRM_DEBUG("CRTC[%d]: %s!\n", crtc->crtc_id, \
+              connected ? "connected" : "disconnected");
+
+  return drm_crtc_valid(crtc);
+}
+
+static int drm_crtc_update_offsets(drm_ctx *ctx, drm_crtc *crtc,
+                                   drm_cursor_state *cursor_state)
+{
+  int x, y, off_x, off_y, width, height, area_w, area_h;
+  float scale_x, scale_y;
+
+  if (drm_update_crtc(ctx, crtc) < 0)
+    return -1;
+
+  width = cursor_state->width;
+  height = cursor_state->height;
+
+  if (ctx->scale_from) {
+    scale_x = scale_y =
+      ctx->scale_from * crtc->width * crtc->height / width / height;
+  } else {
+    scale_x = ctx->scale_x ? ctx->scale_x : 1.0;
+    scale_y = ctx->scale_y ? ctx->scale_y : 1.0;
+  }
+
+  width *= scale_x;
+  height *= scale_y;
+
+  x = cursor_state->x + cursor_state->hot_x - cursor_state->hot_x * scale_x;
+  y = cursor_state->y + cursor_state->hot_y - cursor_state->hot_y * scale_y;
+  area_w = crtc->width - width;
+  area_h = crtc->height - height;
+
+  off_x = off_y = 0;
+
+  if (x < 0)
+    off_x = x;
+
+  if (y < 0)
+    off_y = y;
+
+  if (x > area_w)
+    off_x = x - area_w;
+
+  if (y > area_h)
+    off_y = y - area_h;
+
+  cursor_state->scaled_x = x;
+  cursor_state->scaled_y = y;
+  cursor_state->off_x = off_x;
+  cursor_state->off_y = off_y;
+  cursor_state->scaled_w = width;
+  cursor_state->scaled_h = height;
+
+  return 0;
+}
+
+static drm_fb_entry *drm_crtc_find_fb(drm_crtc *crtc,
+                                      drm_cursor_state *cursor_state,
+                                      int fb_w, int fb_h, int off_x, int off_y)
+{
+  int i;
+
+  if (!cursor_state->hash)
+    return NULL;
+
+  for (i = 0; i < DRM_FB_CACHE_MAX; i++) {
+    drm_fb_entry *entry = &crtc->fb_cache[i];
+
+    if (entry->fb && entry->hash == cursor_state->hash &&
+        entry->width == cursor_state->width &&
+        entry->height == cursor_state->height &&
+        entry->scaled_w == fb_w && entry->scaled_h == fb_h &&
+        entry->off_x == off_x && entry->off_y == off_y)
+      return entry;
+  }
+
+  return NULL;
+}
+
+/* Remove the FB unless it's cached */
+static void drm_crtc_put_fb(drm_ctx *ctx, drm_crtc *crtc, uint32_t fb)
+{
+  int i;
+
+  for (i = 0; i < DRM_FB_CACHE_MAX; i++) {
+    if (crtc->fb_cache[i].fb == fb)
+      return;
+  }
+
+  DRM_DEBUG("CRTC[%d]: remove FB: %d\n", crtc->crtc_id, fb);
+
+  if (crtc->backend_ctx)
+    crtc->backend->release_fb(crtc->backend_ctx, fb);
+
+  drmModeRmFB(ctx->fd, fb);
+}
+
+static int drm_crtc_is_retiring(drm_crtc *crtc, uint32_t fb)
+{
+  int i;
+
+  for (i = 0; i < crtc->num_retiring; i++) {
+    if (crtc->retiring_fbs[i] == fb)
+      return 1;
+  }
+
+  return 0;
+}
+
+static void drm_crtc_evict_fb(drm_ctx *ctx, drm_crtc *crtc,
+                              drm_fb_entry *entry)
+{
+  uint32_t fb = entry->fb;
+
+  DRM_DEBUG("CRTC[%d]: evict FB: %d\n", crtc->crtc_id, fb);
+
+  crtc->fb_cache_size -= entry->size;
+  memset(entry, 0, sizeof(*entry));
+
+  /**
+   * The FB on screen would be retired when replaced, and the retiring ones
+   * released when their flip completed.
+   */
+  if (fb == crtc->cursor_curr.fb || drm_crtc_is_retiring(crtc, fb))
+    return;
+
+  drm_crtc_put_fb(ctx, crtc, fb);
+}
+
+static void drm_crtc_flush_fbs(drm_ctx *ctx, drm_crtc *crtc)
+{
+  int i;
+
+  for (i = 0; i < DRM_FB_CACHE_MAX; i++) {
+    if (crtc->fb_cache[i].fb)
+      drm_crtc_evict_fb(ctx, crtc, &crtc->fb_cache[i]);
+  }
+}
+
+/* Make room for a new FB, returns the free entry */
+static drm_fb_entry *drm_crtc_reserve_fb(drm_ctx *ctx, drm_crtc *crtc,
+                                         uint32_t size)
+{
+  drm_fb_entry *entry, *free_entry;
+  int i;
+
+  if (size > ctx->fb_cache_budget)
+    return NULL;
+
+  while (1) {
+    entry = free_entry = NULL;
+
+    for (i = 0; i < DRM_FB_CACHE_MAX; i++) {
+      if (!crtc->fb_cache[i].fb)
+        free_entry = &crtc->fb_cache[i];
+      else if (!entry || crtc->fb_cache[i].last_used < entry->last_used)
+        entry = &crtc->fb_cache[i];
+    }
+
+    if (free_entry && crtc->fb_cache_size + size <= ctx->fb_cache_budget)
+      return free_entry;
+
+    /* Evict the least recently used one */
+    drm_crtc_evict_fb(ctx, crtc, entry);
+  }
+}
+
+static void drm_crtc_release_retired(drm_ctx *ctx, drm_crtc *crtc)
+{
+  int i;
+
+  /* Shown again, would be retired when replaced */
+  for (i = 0; i < crtc->num_retiring; i++) {
+    if (crtc->retiring_fbs[i] != crtc->cursor_curr.fb)
+      drm_crtc_put_fb(ctx, crtc, crtc->retiring_fbs[i]);
+  }
+
+  crtc->num_retiring = 0;
+}
+
+/* Free buffers for converting, when no flip would retire them */
+static void drm_crtc_reclaim_fbs(drm_ctx *ctx, drm_crtc *crtc)
+{
+  drm_fb_entry *entry = NULL;
+  int i;
+
+  if (crtc->num_retiring) {
+    drm_crtc_release_retired(ctx, crtc);
+    return;
+  }
+
+  /* Evict the least recently used one not on screen */
+  for (i = 0; i < DRM_FB_CACHE_MAX; i++) {
+    drm_fb_entry *tmp = &crtc->fb_cache[i];
+
+    if (tmp->fb && tmp->fb != crtc->cursor_curr.fb &&
+        (!entry || tmp->last_used < entry->last_used))
+      entry = tmp;
+  }
+
+  if (entry)
+    drm_crtc_evict_fb(ctx, crtc, entry);
+}
+
+/* Put the FB replaced on screen, once the display retired it */
+static void drm_crtc_retire_fb(drm_ctx *ctx, drm_crtc *crtc, uint32_t fb)
+{
+  int i;
+
+  /**
+   * Cached FBs are tracked too, in case of being evicted before retired.
+   * They are released by the cache otherwise.
+   */
+  if (drm_crtc_is_retiring(crtc, fb))
+    return;
+
+  /* Frames' FBs are released when the animation ends */
+  for (i = 0; i < crtc->anim_num; i++) {
+    if (crtc->anim_frames[i].fb == fb)
+      return;
+  }
+
+  /**
+   * Without the flip fence, assume the FBs replaced before the last commit
+   * retired by now.
+   */
+  if (crtc->flip_fence < 0 || crtc->num_retiring == DRM_MAX_RETIRING_FBS)
+    drm_crtc_release_retired(ctx, crtc);
+
+  crtc->retiring_fbs[crtc->num_retiring++] = fb;
+}
+
+/* Content hash of the cursor pixels, 0 for unknown */
+static uint64_t drm_crtc_hash_cursor(drm_ctx *ctx, drm_crtc *crtc,
+                                     drm_cursor_state *cursor_state)
+{
+  struct dma_buf_sync sync = { 0, };
+  size_t size = cursor_state->width * cursor_state->height * 4;
+  const void *ptr;
+  uint64_t hash;
+  int dma_fd;
+
+  if (drmPrimeHandleToFD(ctx->fd, cursor_state->handle, DRM_CLOEXEC,
+                         &dma_fd) < 0)
+    return 0;
+
+  ptr = mmap(NULL, size, PROT_READ, MAP_SHARED, dma_fd, 0);
+  if (ptr == MAP_FAILED) {
+    DRM_DEBUG("CRTC[%d]: failed to map cursor BO\n", crtc->crtc_id);
+    close(dma_fd);
+    return 0;
+  }
+
+  sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+  ioctl(dma_fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+  hash = drm_hash_pixels(ptr, size);
+
+  sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+  ioctl(dma_fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+  munmap((void *)ptr, size);
+  close(dma_fd);
+  return hash;
+}
+
+#define drm_crtc_disable_cursor(ctx, crtc) \
+  drm_crtc_update_cursor(ctx, crtc, NULL)
+
+static int drm_crtc_update_cursor(drm_ctx *ctx, drm_crtc *crtc,
+                                  drm_cursor_state *cursor_state)
+{
+  drm_plane *plane = crtc->plane;
+  uint32_t old_fb = crtc->cursor_curr.fb;
+  uint32_t fb;
+  int src_x, src_y, src_w, src_h, x, y, w, h, fb_w, fb_h, ret;
+
+  /* Disable */
+  if (!cursor_state) {
+    if (old_fb) {
+      DRM_DEBUG("CRTC[%d]: disabling cursor\n", crtc->crtc_id);
+      drm_set_plane(ctx, crtc, plane, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+      drm_crtc_retire_fb(ctx, crtc, old_fb);
+    }
+
+    memset(&crtc->cursor_curr, 0, sizeof(drm_cursor_state));
+    return 0;
+  }
+
+  /* Unchanged */
+  if (crtc->cursor_curr.fb == cursor_state->fb &&
+      crtc->cursor_curr.scaled_x == cursor_state->scaled_x &&
+      crtc->cursor_curr.scaled_y == cursor_state->scaled_y &&
+      crtc->cursor_curr.off_x == cursor_state->off_x &&
+      crtc->cursor_curr.off_y == cursor_state->off_y) {
+    crtc->cursor_curr = *cursor_state;
+    return 0;
+  }
+
+  fb = cursor_state->fb;
+
+  /* Unscaled FB, scaled by the plane */
+  fb_w = cursor_state->hw_scaled ?
+    cursor_state->width : cursor_state->scaled_w;
+  fb_h = cursor_state->hw_scaled ?
+    cursor_state->height : cursor_state->scaled_h;
+
+  if (crtc->src_clip > 0) {
+    /* Crop the offsets out of the FB */
+    src_x = cursor_state->off_x < 0 ? -cursor_state->off_x : 0;
+    src_y = cursor_state->off_y < 0 ? -cursor_state->off_y : 0;
+    x = cursor_state->scaled_x + src_x;
+    y = cursor_state->scaled_y + src_y;
+    w = cursor_state->scaled_w - abs(cursor_state->off_x);
+    h = cursor_state->scaled_h - abs(cursor_state->off_y);
+
+    /* Totally out of screen */
+    if (w <= 0 || h <= 0)
+      fb = w = h = 0;
+
+    /* Map the crop into the FB */
+    src_x = src_x * fb_w / cursor_state->scaled_w;
+    src_y = src_y * fb_h / cursor_state->scaled_h;
+    src_w = w * fb_w / cursor_state->scaled_w;
+    src_h = h * fb_h / cursor_state->scaled_h;
+    if (w && !src_w)
+      src_w = 1;
+    if (h && !src_h)
+      src_h = 1;
+  } else {
+    /* The offsets are rendered into the FB */
+    src_x = src_y = 0;
+    src_w = fb_w;
+    src_h = fb_h;
+    x = cursor_state->scaled_x - cursor_state->off_x;
+    y = cursor_state->scaled_y - cursor_state->off_y;
+    w = cursor_state->scaled_w;
+    h = cursor_state->scaled_h;
+  }
+
+  DRM_DEBUG("CRTC[%d]: setting fb: %d (%dx%d+%d+%d) on plane: %d "
+            "at (%d,%d) (%dx%d)\n", crtc->crtc_id, fb, src_w, src_h,
+            src_x, src_y, plane->plane_id, x, y, w, h);
+
+  ret = drm_set_plane(ctx, crtc, plane, fb, src_x, src_y, src_w, src_h,
+                      x, y, w, h);
+  if (ret)
+    DRM_ERROR("CRTC[%d]: failed to set plane (%d)\n", crtc->crtc_id, errno);
+
+  if (old_fb && old_fb != cursor_state->fb)
+    drm_crtc_retire_fb(ctx, crtc, old_fb);
+
+  crtc->cursor_curr = *cursor_state;
+  return ret;
+}
+
+static void *drm_crtc_init_backend_ctx(drm_ctx *ctx, drm_crtc *crtc,
+                                       const drm_backend *backend)
+{
+  uint64_t modifier;
+  int format;
+
+  /* The CPU backend renders linear dumb buffers */
+  if (backend == &cpu_backend && crtc->use_afbc_modifier) {
+    if (!crtc->plane->info->can_linear)
+      return NULL;
+
+    crtc->use_afbc_modifier = 0;
+  }
+
+  if (crtc->use_afbc_modifier) {
+    /* Mali only support AFBC with BGR formats now */
+    format = GBM_FORMAT_ABGR8888;
+    modifier = DRM_AFBC_MODIFIER;
+  } else {
+    format = GBM_FORMAT_ARGB8888;
+    modifier = 0;
+  }
+
+  /* Cursor planes might require exact sized FBs */
+  return backend->init_ctx(ctx->fd, ctx->num_surfaces, format, modifier,
+                           crtc->plane->cursor_plane ?
+                           0 : ctx->surface_pool_size,
+                           ctx->backend_cache_file);
+}
 
-  ctx->configs = malloc(st.st_size + 1);
-  if (!ctx->configs)
-    goto out_unmap;
+static int drm_crtc_init_backend(drm_ctx *ctx, drm_crtc *crtc)
+{
+  crtc->backend = ctx->backend;
+  crtc->backend_ctx = drm_crtc_init_backend_ctx(ctx, crtc, crtc->backend);
+  if (crtc->backend_ctx)
+    return 0;
 
-  memcpy(ctx->configs, ptr, st.st_size);
-  ctx->configs[st.st_size] = '\0';
+  DRM_ERROR("CRTC[%d]: failed to init %s backend\n",
+            crtc->crtc_id, crtc->backend->name);
 
-  tmp = ctx->configs;
-  while ((tmp = strchr(tmp, '#'))) {
-    while (*tmp != '\n' && *tmp != '\0')
-      *tmp++ = '\n';
+  /* Fallback to the CPU backend */
+  if (crtc->backend == &cpu_backend)
+    return -1;
+
+  crtc->backend = &cpu_backend;
+  crtc->backend_ctx = drm_crtc_init_backend_ctx(ctx, crtc, crtc->backend);
+  if (!crtc->backend_ctx) {
+    DRM_ERROR("CRTC[%d]: failed to init %s backend\n",
+              crtc->crtc_id, crtc->backend->name);
+    return -1;
   }
 
-out_unmap:
-  munmap(ptr, st.st_size);
-out_close_fd:
-  close(fd);
+  DRM_INFO("CRTC[%d]: fallback to %s backend\n",
+           crtc->crtc_id, crtc->backend->name);
+  return 0;
 }
 
-static const char *drm_get_config(drm_ctx *ctx, const char *name)
+static int drm_crtc_create_fb(drm_ctx *ctx, drm_crtc *crtc,
+                              drm_cursor_state *cursor_state)
 {
-  static char buf[4096];
-  const char *config;
+  uint32_t handle = cursor_state->handle;
+  int width = cursor_state->width;
+  int height = cursor_state->height;
+  int scaled_w = cursor_state->scaled_w;
+  int scaled_h = cursor_state->scaled_h;
+  int off_x, off_y, fb_w, fb_h;
+  drm_fb_entry *entry;
+  int probe_clip = crtc->src_clip < 0;
+  int hw_scale, hit, dedup;
+  uint32_t size;
+  int keep;
+
+  /* Rendered again within the call when the probes failed */
+again:
+  off_x = cursor_state->off_x;
+  off_y = cursor_state->off_y;
+  fb_w = scaled_w;
+  fb_h = scaled_h;
+  entry = NULL;
+  hw_scale = hit = dedup = 0;
+
+  /* Render unshifted FBs when clipping by the plane's SRC rect */
+  if (crtc->src_clip)
+    off_x = off_y = 0;
+
+  /* Keep the FB unscaled, scaled by the plane */
+  if ((width != scaled_w || height != scaled_h) && !off_x && !off_y &&
+      drm_crtc_get_hw_scale(ctx, crtc, cursor_state)) {
+    hw_scale = 1;
+    fb_w = width;
+    fb_h = height;
+  }
 
-  if (!ctx->configs)
-    return NULL;
+  cursor_state->hw_scaled = hw_scale;
+  cursor_state->direct = 0;
+  size = fb_w * fb_h * 4;
+
+  /* Nothing to convert for linear planes */
+  if (crtc->direct_scanout && crtc->plane->info->can_linear &&
+      width == fb_w && height == fb_h && !off_x && !off_y) {
+    cursor_state->fb = drm_crtc_add_direct_fb(ctx, crtc, cursor_state);
+    if (cursor_state->fb) {
+      DRM_DEBUG("CRTC[%d]: scanout %d directly with FB: %d\n",
+                crtc->crtc_id, handle, cursor_state->fb);
+      cursor_state->direct = 1;
+      goto out;
+    }
+  }
 
-  config = strstr(ctx->configs, name);
-  if (!config)
-    return NULL;
+  if (ctx->fb_cache_budget && cursor_state->hash) {
+    entry = drm_crtc_find_fb(crtc, cursor_state, fb_w, fb_h, off_x, off_y);
+    hit = !!entry;
 
-  if (config[strlen(name)] == '\n' || config[strlen(name)] == '\r')
-    return NULL;
+    if (entry && entry->handle != handle) {
+      DRM_DEBUG("CRTC[%d]: %d has the same content as %d\n",
+                crtc->crtc_id, handle, entry->handle);
+      dedup = 1;
+      entry->handle = handle;
+    }
+  }
 
-  sscanf(config + strlen(name), "%4095s", buf);
-  return buf;
+  if (entry) {
+    entry->last_used = ++crtc->fb_cache_tick;
+    cursor_state->fb = entry->fb;
+
+    DRM_DEBUG("CRTC[%d]: reuse FB: %d\n", crtc->crtc_id, entry->fb);
+    goto out;
+  }
+
+  DRM_DEBUG("CRTC[%d]: convert FB from %d (%dx%d) to (%dx%d) offset: (%d,%d)\n",
+            crtc->crtc_id, handle, width, height,
+            fb_w, fb_h, off_x, off_y);
+
+  if (!crtc->backend_ctx && drm_crtc_init_backend(ctx, crtc) < 0)
+    return -1;
+
+  /* Make room in the cache only once the backend agreed to keep it */
+  keep = ctx->fb_cache_budget && cursor_state->hash &&
+    size <= ctx->fb_cache_budget;
+  cursor_state->fb =
+    crtc->backend->convert_fb(ctx->fd, crtc->backend_ctx, handle,
+                              width, height, fb_w, fb_h,
+                              off_x, off_y, &keep);
+  if (!cursor_state->fb) {
+    /* Keep the current FB until the display retired some buffers */
+    if (errno == EBUSY) {
+      DRM_DEBUG("CRTC[%d]: no retired buffer to convert\n", crtc->crtc_id);
+      crtc->convert_busy = 1;
+      return -1;
+    }
+
+    DRM_ERROR("CRTC[%d]: failed to create FB\n", crtc->crtc_id);
+    return -1;
+  }
+
+  if (crtc->backend->take_fence) {
+    drm_crtc_release_render_fence(crtc);
+    crtc->render_fence = crtc->backend->take_fence(crtc->backend_ctx);
+    crtc->render_fence_fb = cursor_state->fb;
+  }
+
+  if (keep)
+    entry = drm_crtc_reserve_fb(ctx, crtc, size);
+
+  if (entry) {
+    entry->fb = cursor_state->fb;
+    entry->size = size;
+    entry->last_used = ++crtc->fb_cache_tick;
+    entry->handle = handle;
+    entry->hash = cursor_state->hash;
+    entry->width = width;
+    entry->height = height;
+    entry->scaled_w = fb_w;
+    entry->scaled_h = fb_h;
+    entry->off_x = off_x;
+    entry->off_y = off_y;
+    crtc->fb_cache_size += size;
+  }
+
+  DRM_DEBUG("CRTC[%d]: created FB: %d\n", crtc->crtc_id, cursor_state->fb);
+
+out:
+  /* The failed probe is recorded, scaled by the backend next time */
+  if (hw_scale && drm_crtc_get_hw_scale(ctx, crtc, cursor_state) < 0 &&
+      !drm_crtc_probe_hw_scale(ctx, crtc, cursor_state->fb, cursor_state)) {
+    drm_crtc_put_fb(ctx, crtc, cursor_state->fb);
+    goto again;
+  }
+
+  if (probe_clip) {
+    probe_clip = 0;
+    crtc->src_clip = drm_crtc_probe_clip(ctx, crtc, cursor_state->fb,
+                                         fb_w, fb_h);
+
+    /* Rendered with the offsets next time */
+    if (!crtc->src_clip && (cursor_state->off_x || cursor_state->off_y)) {
+      drm_crtc_put_fb(ctx, crtc, cursor_state->fb);
+      goto again;
+    }
+  }
+
+  /* Counted once for each request, by its final lookup */
+  if (ctx->fb_cache_budget && cursor_state->hash && !cursor_state->direct) {
+    if (hit)
+      crtc->fb_cache_hits++;
+    else
+      crtc->fb_cache_misses++;
+
+    crtc->fb_cache_dedups += dedup;
+
+    if ((crtc->fb_cache_hits + crtc->fb_cache_misses) %
+        DRM_FB_CACHE_REPORT_COUNT == 0)
+      DRM_INFO("CRTC[%d]: FB cache hits: %d (dedup: %d) misses: %d\n",
+               crtc->crtc_id, crtc->fb_cache_hits, crtc->fb_cache_dedups,
+               crtc->fb_cache_misses);
+  }
+
+  return 0;
 }
 
-static int drm_get_config_int(drm_ctx *ctx, const char *name, int def)
+/* Get the frame's FB, holding direct FBs until the animation ends */
+static int drm_crtc_get_frame_fb(drm_ctx *ctx, drm_crtc *crtc,
+                                 drm_cursor_state *cursor_state,
+                                 drm_anim_frame *frame)
 {
-  const char *config = drm_get_config(ctx, name);
+  cursor_state->handle = frame->handle;
+  cursor_state->hash = frame->hash;
+
+  /* Direct FBs are unshifted */
+  if (frame->fb && (crtc->src_clip > 0 ||
+                    (!cursor_state->off_x && !cursor_state->off_y))) {
+    cursor_state->fb = frame->fb;
+    cursor_state->hw_scaled = frame->hw_scaled;
+    cursor_state->direct = 1;
+    return 0;
+  }
 
-  if (config)
-    return atoi(config);
+  if (drm_crtc_create_fb(ctx, crtc, cursor_state) < 0)
+    return -1;
 
-  return def;
+  if (cursor_state->direct && !frame->fb) {
+    frame->fb = cursor_state->fb;
+    frame->hw_scaled = cursor_state->hw_scaled;
+  }
+
+  return 0;
 }
 
-static drm_ctx *drm_get_ctx(int fd)
+/* End the animation, the shown frame's FB would be retired when replaced */
+static void drm_crtc_stop_anim(drm_ctx *ctx, drm_crtc *crtc)
 {
-  drm_ctx *ctx = &g_drm_ctx;
-  uint32_t prefer_planes[DRM_MAX_CRTCS] = { 0, };
-  uint32_t prefer_plane = 0;
-  uint32_t i, max_fps, count_crtcs;
-  const char *config;
+  int i, num = crtc->anim_num;
 
-  if (fd < 0)
-    return ctx;
+  if (!num)
+    return;
 
-  if (ctx->inited) {
-    /* Make sure the ctx's fd is the same as the input fd */
-    int flags = fcntl(ctx->fd, F_GETFL, 0);
-    if (fcntl(fd, F_GETFL, 0) == flags) {
-      fcntl(ctx->fd, F_SETFL, flags ^ O_NONBLOCK);
-      if (fcntl(fd, F_GETFL, 0) != flags) {
-        fcntl(ctx->fd, F_SETFL, flags);
-        return ctx;
-      }
+  DRM_DEBUG("CRTC[%d]: stop animation\n", crtc->crtc_id);
+
+  crtc->anim_num = 0;
+  for (i = 0; i < num; i++) {
+    uint32_t fb = crtc->anim_frames[i].fb;
+
+    if (fb && fb != crtc->cursor_curr.fb)
+      drm_crtc_retire_fb(ctx, crtc, fb);
+  }
+}
+
+/* Take the frames of the new cursor, and convert them ahead */
+static void drm_crtc_load_anim(drm_ctx *ctx, drm_crtc *crtc,
+                               drm_cursor_state *cursor_state)
+{
+  drm_cursor_state state;
+  int i;
+
+  drm_crtc_stop_anim(ctx, crtc);
+
+  /* The frames might be of a newer request, which would come next */
+  pthread_mutex_lock(&crtc->mutex);
+  if (crtc->anim_pending_num &&
+      crtc->anim_pending[0].handle == cursor_state->handle) {
+    crtc->anim_num = crtc->anim_pending_num;
+    memcpy(crtc->anim_frames, crtc->anim_pending,
+           crtc->anim_num * sizeof(drm_anim_frame));
+  }
+  pthread_mutex_unlock(&crtc->mutex);
+
+  if (!crtc->anim_num)
+    return;
+
+  DRM_DEBUG("CRTC[%d]: animate %d frames\n", crtc->crtc_id, crtc->anim_num);
+
+  for (i = 0; i < crtc->anim_num; i++) {
+    drm_anim_frame *frame = &crtc->anim_frames[i];
+
+    if (crtc->backend_ctx && crtc->backend->invalidate)
+      crtc->backend->invalidate(crtc->backend_ctx, frame->handle);
+
+    state = *cursor_state;
+    state.handle = frame->handle;
+    if (ctx->fb_cache_budget)
+      frame->hash = drm_crtc_hash_cursor(ctx, crtc, &state);
+
+    /* Convert into direct FBs or the FB cache, or on the fly otherwise */
+    if (drm_crtc_get_frame_fb(ctx, crtc, &state, frame) < 0) {
+      crtc->convert_busy = 0;
+      continue;
     }
 
-    close(ctx->fd);
-    ctx->fd = dup(fd);
-    return ctx;
+    if (state.fb != frame->fb)
+      drm_crtc_put_fb(ctx, crtc, state.fb);
   }
 
-  /* Failed already */
-  if (ctx->fd < 0)
-    return NULL;
+  crtc->anim_index = 0;
+  crtc->anim_time = drm_curr_time() + crtc->anim_frames[0].duration;
+}
 
-  ctx->fd = dup(fd);
-  if (ctx->fd < 0)
-    return NULL;
+static void drm_crtc_post_request(drm_crtc *crtc, int request)
+{
+  uint64_t one = 1;
 
-  drm_load_configs(ctx);
+  /* Only the first request since the last drain needs to wake the thread */
+  if (atomic_fetch_or_explicit(&crtc->next_request, request,
+                               memory_order_release))
+    return;
 
-  g_drm_debug = drm_get_config_int(ctx, OPT_DEBUG, 0);
+  if (write(crtc->event_fd, &one, sizeof(one)) < 0)
+    DRM_ERROR("CRTC[%d]: failed to wake thread (%d)\n", crtc->crtc_id, errno);
+}
 
-  if (getenv("DRM_DEBUG") || !access("/tmp/.drm_cursor_debug", F_OK))
-    g_drm_debug = 1;
+static void drm_crtc_drain_events(drm_crtc *crtc)
+{
+  uint64_t count;
 
-  if (!(config = getenv("DRM_CURSOR_LOG_FILE")))
-    config = drm_get_config(ctx, OPT_LOG_FILE);
+  if (read(crtc->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    DRM_ERROR("CRTC[%d]: failed to read events (%d)\n", crtc->crtc_id, errno);
+}
 
-  g_log_fp = fopen(config ? config : "/var/log/drm-cursor.log", "wb+");
+static void drm_crtc_write_next(drm_crtc *crtc, uint32_t handle,
+                                int width, int height, int hot_x, int hot_y)
+{
+  drm_cursor_state *cursor_next = &crtc->cursor_next;
+  unsigned seq = atomic_load_explicit(&crtc->next_seq, memory_order_relaxed);
 
-  ctx->atomic = drm_get_config_int(ctx, OPT_ATOMIC, 1);
-  DRM_INFO("atomic drm API %s\n", ctx->atomic ? "enabled" : "disabled");
+  atomic_store_explicit(&crtc->next_seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
 
-  ctx->hide = drm_get_config_int(ctx, OPT_HIDE, 0);
-  if (ctx->hide)
-    DRM_INFO("invisible cursors\n");
+  cursor_next->handle = handle;
+  cursor_next->width = width;
+  cursor_next->height = height;
+  cursor_next->hot_x = hot_x;
+  cursor_next->hot_y = hot_y;
 
-#ifdef PREFER_AFBC_MODIFIER
-  ctx->prefer_afbc_modifier = 1;
-#endif
+  atomic_store_explicit(&crtc->next_seq, seq + 2, memory_order_release);
+}
 
-  ctx->prefer_afbc_modifier =
-    drm_get_config_int(ctx, OPT_PREFER_AFBC, ctx->prefer_afbc_modifier);
+static void drm_crtc_read_next(drm_crtc *crtc, drm_cursor_state *cursor_state)
+{
+  uint64_t pos;
+  unsigned seq;
 
-  if (ctx->prefer_afbc_modifier)
-    DRM_DEBUG("prefer ARM AFBC modifier\n");
+  do {
+    seq = atomic_load_explicit(&crtc->next_seq, memory_order_acquire);
+    if (seq & 1)
+      continue;
 
-  ctx->allow_overlay = drm_get_config_int(ctx, OPT_ALLOW_OVERLAY, 0);
+    *cursor_state = crtc->cursor_next;
+    atomic_thread_fence(memory_order_acquire);
+  } while ((seq & 1) ||
+           seq != atomic_load_explicit(&crtc->next_seq, memory_order_relaxed));
 
-  if (ctx->allow_overlay)
-    DRM_DEBUG("allow overlay planes\n");
+  pos = atomic_load_explicit(&crtc->next_pos, memory_order_relaxed);
+  cursor_state->x = DRM_CURSOR_POS_X(pos);
+  cursor_state->y = DRM_CURSOR_POS_Y(pos);
+  cursor_state->fb = 0;
+}
 
-  drmSetClientCap(ctx->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+static uint32_t drm_crtc_get_prop_id(drm_ctx *ctx, drm_crtc *crtc,
+                                     const char *name)
+{
+  drmModeObjectPropertiesPtr props;
+  drmModePropertyPtr prop;
+  uint32_t i, prop_id = 0;
 
-  ctx->num_surfaces = drm_get_config_int(ctx, OPT_NUM_SURFACES, 8);
+  props = drmModeObjectGetProperties(ctx->fd, crtc->crtc_id,
+                                     DRM_MODE_OBJECT_CRTC);
+  if (!props)
+    return 0;
 
-  max_fps = drm_get_config_int(ctx, OPT_MAX_FPS, 0);
-  if (max_fps <= 0)
-    max_fps = 60;
+  for (i = 0; !prop_id && i < props->count_props; i++) {
+    prop = drmModeGetProperty(ctx->fd, props->props[i]);
+    if (prop && !strcmp(prop->name, name))
+      prop_id = prop->prop_id;
+    drmModeFreeProperty(prop);
+  }
 
-  ctx->min_interval = 1000 / max_fps;
-  if (ctx->min_interval)
-    ctx->min_interval--;
+  drmModeFreeObjectProperties(props);
+  return prop_id;
+}
 
-  DRM_INFO("max fps: %d\n", max_fps);
+static int drm_crtc_thread_init(drm_ctx *ctx, drm_crtc *crtc)
+{
+  drm_plane *plane = crtc->plane;
+  uint64_t start = drm_curr_time();
 
-  config = drm_get_config(ctx, OPT_SCALE_FROM);
-  if (config) {
-    int w, h, screen_w, screen_h;
-    if (config &&
-        sscanf(config, "%dx%d/%dx%d", &w, &h, &screen_w, &screen_h) == 4) {
-      ctx->scale_from = 1.0 * w * h / screen_w / screen_h;
-      DRM_INFO("scale from: %s\n", config);
-    }
-  } else {
-    config = drm_get_config(ctx, OPT_SCALE);
-    if (config && sscanf(config, "%fx%f", &ctx->scale_x, &ctx->scale_y) == 2)
-      DRM_INFO("scale: %s\n", config);
+  if (!plane->cursor_plane) {
+    drmSetClientCap(ctx->fd, DRM_CLIENT_CAP_ATOMIC, 1);
+
+    /* Reflush props with atomic cap enabled */
+    if (drm_catalog_update_atomic(ctx) < 0)
+      return -1;
+
+    /* Set maximum ZPOS */
+    drm_plane_set_prop_max(ctx, plane, PLANE_PROP_zpos);
+    drm_plane_set_prop_max(ctx, plane, PLANE_PROP_ZPOS);
+
+    /* Set async commit for Rockchip BSP kernel */
+    crtc->async_commit =
+      !drm_plane_set_prop_max(ctx, plane, PLANE_PROP_ASYNC_COMMIT);
+    if (crtc->async_commit)
+      DRM_INFO("CRTC[%d]: using async commit\n", crtc->crtc_id);
+
+    if (ctx->atomic && drm_plane_init_commit(plane) < 0)
+      DRM_ERROR("CRTC[%d]: failed to init atomic commit\n", crtc->crtc_id);
   }
 
-  ctx->res = drmModeGetResources(ctx->fd);
-  if (!ctx->res)
-    goto err_free_configs;
+  /* Flip pacing needs atomic commits with out-fences */
+  crtc->flip_pacing = 0;
+  if (ctx->flip_pacing && ctx->atomic &&
+      !plane->cursor_plane && !crtc->async_commit) {
+    crtc->out_fence_prop = drm_crtc_get_prop_id(ctx, crtc, "OUT_FENCE_PTR");
+    crtc->flip_pacing = !!crtc->out_fence_prop;
+  }
 
-  ctx->pres = drmModeGetPlaneResources(ctx->fd);
-  if (!ctx->pres)
-    goto err_free_res;
+  DRM_DEBUG("CRTC[%d]: pacing by %s\n", crtc->crtc_id,
+            crtc->flip_pacing ? "flip completion" : "max fps");
 
-  count_crtcs = ctx->res->count_crtcs;
+  crtc->src_clip = ctx->edge_clip ? -1 : 0;
+  crtc->direct_scanout = ctx->direct_scanout ? -1 : 0;
+  crtc->hw_scale = -1;
 
-  /* Allow specifying prefer plane */
-  if ((config = getenv("DRM_CURSOR_PREFER_PLANE")))
-    prefer_plane = atoi(config);
-  else
-    prefer_plane = drm_get_config_int(ctx, OPT_PREFER_PLANE, 0);
+  /* Build the backend ahead, failures are retried with the first cursor */
+  if (crtc->prewarm && !crtc->backend_ctx) {
+    drm_crtc_init_backend(ctx, crtc);
 
-  /* Allow specifying prefer planes */
-  if (!(config = getenv("DRM_CURSOR_PREFER_PLANES")))
-    config = drm_get_config(ctx, OPT_PREFER_PLANES);
-  for (i = 0; config && i < count_crtcs; i++) {
-    prefer_planes[i] = atoi(config);
+    crtc->prewarm_time = drm_curr_time() - start;
+    DRM_INFO("CRTC[%d]: prewarmed in %"PRIu64"us\n",
+             crtc->crtc_id,
+             (uint64_t)(crtc->prewarm_time / NSEC_PER_USEC));
+  }
 
-    config = strchr(config, ',');
-    if (config)
-      config++;
+  crtc->last_update_time = drm_curr_time() - ctx->min_interval;
+  crtc->ready = 1;
+  return 0;
+}
+
+static int drm_crtc_handle_request(drm_ctx *ctx, drm_crtc *crtc, int request)
+{
+  drm_cursor_state cursor_state;
+  uint64_t start = crtc->verified ? 0 : drm_curr_time();
+
+  drm_crtc_read_next(crtc, &cursor_state);
+  cursor_state.request = request;
+  cursor_state.request |= crtc->cursor_curr.request; /* For retry */
+
+  /* For edge moving */
+  if (drm_crtc_update_offsets(ctx, crtc, &cursor_state) < 0) {
+    DRM_DEBUG("CRTC[%d]: unavailable!\n", crtc->crtc_id);
+    drm_crtc_stop_anim(ctx, crtc);
+    drm_crtc_disable_cursor(ctx, crtc);
+
+    /* Force setting cursor in next request */
+    crtc->cursor_curr.request = REQ_SET_CURSOR;
+
+    pthread_mutex_lock(&crtc->mutex);
+    crtc->set_deferred = 1;
+    pthread_cond_signal(&crtc->cond);
+    pthread_mutex_unlock(&crtc->mutex);
+    return 0;
   }
 
-  /* Fetch all CRTCs */
-  for (i = 0; i < count_crtcs; i++) {
-    drmModeCrtcPtr c = drmModeGetCrtc(ctx->fd, ctx->res->crtcs[i]);
-    drm_crtc *crtc = &ctx->crtcs[ctx->num_crtcs];
+  if (cursor_state.request & REQ_SET_CURSOR) {
+    cursor_state.request = 0;
 
-    if (!c)
-      continue;
+    /* Handle set-cursor */
+    DRM_DEBUG("CRTC[%d]: set new cursor %d (%dx%d)\n",
+              crtc->crtc_id, cursor_state.handle,
+              cursor_state.width, cursor_state.height);
+
+    drm_crtc_load_anim(ctx, crtc, &cursor_state);
+
+    if (!cursor_state.handle) {
+      drm_crtc_disable_cursor(ctx, crtc);
+      return 0;
+    }
+
+    if (crtc->anim_num) {
+      if (drm_crtc_get_frame_fb(ctx, crtc, &cursor_state,
+                                &crtc->anim_frames[0]) < 0)
+        return -1;
+    } else {
+      /* The handle might be reused for a new BO, or rewritten */
+      if (crtc->backend_ctx && crtc->backend->invalidate)
+        crtc->backend->invalidate(crtc->backend_ctx, cursor_state.handle);
 
-    crtc->crtc_id = c->crtc_id;
-    crtc->crtc_pipe = i;
-    crtc->prefer_plane_id = prefer_planes[i] ? prefer_planes[i] : prefer_plane;
+      if (ctx->fb_cache_budget)
+        cursor_state.hash = drm_crtc_hash_cursor(ctx, crtc, &cursor_state);
 
-    DRM_DEBUG("found %d CRTC: %d(%d) (%dx%d) prefer plane: %d\n",
-              ctx->num_crtcs, c->crtc_id, i, c->width, c->height,
-              crtc->prefer_plane_id);
+      if (drm_crtc_create_fb(ctx, crtc, &cursor_state) < 0)
+        return -1;
+    }
 
-    ctx->num_crtcs++;
-    drmModeFreeCrtc(c);
-  }
+    if (drm_crtc_update_cursor(ctx, crtc, &cursor_state) < 0) {
+      DRM_ERROR("CRTC[%d]: failed to set cursor\n", crtc->crtc_id);
+      return -1;
+    }
+  } else if (cursor_state.request & (REQ_MOVE_CURSOR | REQ_ANIMATE)) {
+    /* Step to the next frame */
+    if ((cursor_state.request & REQ_ANIMATE) && crtc->anim_num) {
+      uint64_t now = drm_curr_time();
 
-  DRM_DEBUG("found %d CRTCs\n", ctx->num_crtcs);
+      crtc->anim_index = (crtc->anim_index + 1) % crtc->anim_num;
+      crtc->anim_time += crtc->anim_frames[crtc->anim_index].duration;
 
-  if (!ctx->num_crtcs)
-    goto err_free_pres;
+      /* Skip the missed frames' time */
+      if (crtc->anim_time < now)
+        crtc->anim_time = now + crtc->anim_frames[crtc->anim_index].duration;
 
-  config = drm_get_config(ctx, OPT_CRTC_BLOCKLIST);
-  for (i = 0; config && i < count_crtcs; i++) {
-    uint32_t crtc_id = atoi(config);
+      DRM_DEBUG("CRTC[%d]: animate to frame %d\n",
+                crtc->crtc_id, crtc->anim_index);
+    }
 
-    for (int j = 0; j < ctx->num_crtcs; j++) {
-      drm_crtc *crtc = &ctx->crtcs[j];
-      if (crtc->crtc_id != crtc_id)
-        continue;
+    cursor_state.request = 0;
+
+    /* Handle move-cursor */
+    DRM_DEBUG("CRTC[%d]: move cursor to (%d[%d],%d[%d])\n",
+              crtc->crtc_id, cursor_state.scaled_x, -cursor_state.off_x,
+              cursor_state.scaled_y, -cursor_state.off_y);
+
+    cursor_state.hash = crtc->cursor_curr.hash;
+
+    if (!crtc->cursor_curr.handle) {
+      /* Pre-moving */
+      crtc->cursor_curr = cursor_state;
+      return 0;
+    } else if (crtc->anim_num) {
+      /* Animating, the frames' FBs are resident or cached */
+      if (drm_crtc_get_frame_fb(ctx, crtc, &cursor_state,
+                                &crtc->anim_frames[crtc->anim_index]) < 0)
+        return -1;
+    } else if (crtc->cursor_curr.off_x != cursor_state.off_x ||
+               crtc->cursor_curr.off_y != cursor_state.off_y) {
+      /* Edge moving */
+      if (crtc->src_clip > 0) {
+        cursor_state.fb = crtc->cursor_curr.fb;
+        cursor_state.hw_scaled = crtc->cursor_curr.hw_scaled;
+      } else if (drm_crtc_create_fb(ctx, crtc, &cursor_state) < 0)
+        return -1;
+    } else {
+      /* Normal moving */
+      cursor_state.fb = crtc->cursor_curr.fb;
+      cursor_state.hw_scaled = crtc->cursor_curr.hw_scaled;
+    }
 
-      DRM_DEBUG("CRTC: %d blocked\n", crtc_id);
-      crtc->blocked = 1;
+    if (drm_crtc_update_cursor(ctx, crtc, &cursor_state) < 0) {
+      DRM_ERROR("CRTC[%d]: failed to move cursor\n", crtc->crtc_id);
+      return -1;
     }
+  }
 
-    config = strchr(config, ',');
-    if (config)
-      config++;
+  if (!crtc->verified && crtc->cursor_curr.fb) {
+    pthread_mutex_lock(&crtc->mutex);
+    DRM_INFO("CRTC[%d]: it works!\n", crtc->crtc_id);
+    if (crtc->prewarm_time)
+      DRM_INFO("CRTC[%d]: first cursor in %"PRIu64"us, prewarmed ahead\n",
+               crtc->crtc_id,
+               (uint64_t)((drm_curr_time() - start) / NSEC_PER_USEC));
+    crtc->verified = 1;
+    pthread_cond_signal(&crtc->cond);
+    pthread_mutex_unlock(&crtc->mutex);
   }
 
-  if (g_drm_debug) {
-    /* Dump planes for debugging */
-    for (i = 0; i < ctx->pres->count_planes; i++) {
-      drm_plane *plane = drm_get_plane(ctx, ctx->pres->planes[i]);
-      char *type;
-      uint64_t value = 0;
+  return 0;
+}
 
-      if (!plane)
-        continue;
+static void drm_crtc_thread_error(drm_ctx *ctx, drm_crtc *crtc)
+{
+  drm_loop *loop = crtc->loop;
 
-      drm_plane_get_prop_value(ctx, plane, PLANE_PROP_type, &value);
-      switch (value) {
-      case DRM_PLANE_TYPE_PRIMARY:
-        type = "primary";
-        break;
-      case DRM_PLANE_TYPE_OVERLAY:
-        type = "overlay";
-        break;
-      case DRM_PLANE_TYPE_CURSOR:
-        type = "cursor ";
-        break;
-      default:
-        type = "unknown";
-        break;
-      }
+  epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, crtc->event_fd, NULL);
+  atomic_fetch_and(&loop->crtcs, ~(1u << (crtc - ctx->crtcs)));
 
-      DRM_DEBUG("found plane: %d[%s] crtcs: 0x%x %s%s\n",
-                plane->plane_id, type, plane->plane->possible_crtcs,
-                plane->can_linear ? "(ARGB)" : "",
-                plane->can_afbc ? "(AFBC)" : "");
+  /* Drop the update not committed yet */
+  crtc->batching = 0;
+  if (crtc->plane)
+    crtc->plane->batched = 0;
 
-      drm_free_plane(plane);
-    }
+  drm_crtc_release_flip(crtc);
+  drm_crtc_stop_anim(ctx, crtc);
+  drm_crtc_release_retired(ctx, crtc);
+  drm_crtc_release_render_fence(crtc);
+  drm_crtc_flush_fbs(ctx, crtc);
+
+  if (crtc->backend_ctx) {
+    crtc->backend->free_ctx(crtc->backend_ctx);
+    crtc->backend_ctx = NULL;
   }
 
-  DRM_INFO("using libdrm-cursor (%s)\n", LIBDRM_CURSOR_VERSION);
+  if (crtc->plane)
+    drm_crtc_disable_cursor(ctx, crtc);
+
+  drm_crtc_release_retired(ctx, crtc);
 
-  ctx->inited = 1;
-  return ctx;
+  pthread_mutex_lock(&crtc->mutex);
+  DRM_DEBUG("CRTC[%d]: thread error\n", crtc->crtc_id);
+  crtc->state = FATAL_ERROR;
+  crtc->loop = NULL;
 
-err_free_pres:
-  drmModeFreePlaneResources(ctx->pres);
-err_free_res:
-  drmModeFreeResources(ctx->res);
-err_free_configs:
-  free(ctx->configs);
-  close(ctx->fd);
-  ctx->fd = -1;
-  return NULL;
+  if (crtc->plane) {
+    drm_free_plane(crtc->plane);
+    crtc->plane = NULL;
+  }
+
+  pthread_cond_signal(&crtc->cond);
+  pthread_mutex_unlock(&crtc->mutex);
 }
 
-#define drm_crtc_bind_plane_force(ctx, crtc, plane) \
-  drm_crtc_bind_plane(ctx, crtc, plane, 1)
+static void drm_loop_update_deadline(uint64_t *deadline, uint64_t time)
+{
+  if (!*deadline || time < *deadline)
+    *deadline = time;
+}
 
-#define drm_crtc_bind_plane_cursor(ctx, crtc, plane) \
-  drm_crtc_bind_plane(ctx, crtc, plane, 0)
+static int drm_crtc_get_vblank(drm_ctx *ctx, drm_crtc *crtc,
+                               uint32_t *seq, uint64_t *time)
+{
+  drmVBlank vbl;
+
+  memset(&vbl, 0, sizeof(vbl));
+  vbl.request.type = DRM_VBLANK_RELATIVE;
+  if (crtc->crtc_pipe == 1)
+    vbl.request.type |= DRM_VBLANK_SECONDARY;
+  else if (crtc->crtc_pipe > 1)
+    vbl.request.type |= (crtc->crtc_pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+      DRM_VBLANK_HIGH_CRTC_MASK;
+
+  /* Relative 0 returns the last vblank without waiting */
+  if (drmWaitVBlank(ctx->fd, &vbl) < 0)
+    return -1;
 
-static int drm_crtc_bind_plane(drm_ctx *ctx, drm_crtc *crtc, uint32_t plane_id,
-                               int allow_overlay)
+  *seq = vbl.reply.sequence;
+  *time = vbl.reply.tval_sec * NSEC_PER_SEC +
+    vbl.reply.tval_usec * NSEC_PER_USEC;
+  return 0;
+}
+
+static void drm_crtc_report_latch(drm_crtc *crtc, uint32_t seq, uint64_t time)
 {
-  drm_plane *plane;
-  uint64_t value;
-  int i;
+  uint32_t frames = seq - crtc->latch_seq;
+  int64_t error;
 
-  /* CRTC already assigned */
-  if (crtc->plane)
-    return 1;
+  crtc->latch_measuring = 0;
 
-  /* Plane already assigned */
-  for (i = 0; i < ctx->num_crtcs; i++) {
-    if (ctx->crtcs[i].plane && ctx->crtcs[i].plane->plane_id == plane_id)
-      return -1;
-  }
+  /* Where the predicted vblank really happened */
+  error = (int64_t)(time - frames * crtc->vblank_period - crtc->latch_vblank);
+  if (error < 0)
+    error = -error;
 
-  plane = drm_get_plane(ctx, plane_id);
-  if (!plane)
-    return -1;
+  crtc->latch_error_sum += error;
+  if (error > crtc->latch_error_max)
+    crtc->latch_error_max = error;
 
-  /* Unable to use */
-  if (!plane->can_afbc && !plane->can_linear)
-    goto err;
+  DRM_DEBUG("CRTC[%d]: latch phase error: %"PRId64"us\n",
+            crtc->crtc_id, error / (int64_t)NSEC_PER_USEC);
 
-  /* Not for this CRTC */
-  if (!(plane->plane->possible_crtcs & (1 << crtc->crtc_pipe)))
-    goto err;
+  if (++crtc->latch_count < DRM_LATCH_REPORT_COUNT)
+    return;
 
-  /* Not using primary planes */
-  if (drm_plane_get_prop_value(ctx, plane, PLANE_PROP_type, &value) < 0)
-    goto err;
+  DRM_INFO("CRTC[%d]: latch phase error avg: %"PRId64"us max: %"PRId64"us "
+           "slack avg: %"PRId64"us missed: %d/%d\n", crtc->crtc_id,
+           crtc->latch_error_sum / crtc->latch_count / (int64_t)NSEC_PER_USEC,
+           crtc->latch_error_max / (int64_t)NSEC_PER_USEC,
+           crtc->latch_slack_sum / crtc->latch_count / (int64_t)NSEC_PER_USEC,
+           crtc->latch_missed, crtc->latch_count);
 
-  if (value == DRM_PLANE_TYPE_PRIMARY)
-    goto err;
+  crtc->latch_error_sum = crtc->latch_error_max = crtc->latch_slack_sum = 0;
+  crtc->latch_count = crtc->latch_missed = 0;
+}
 
-  /* Check for overlay plane */
-  if (!allow_overlay && value == DRM_PLANE_TYPE_OVERLAY)
-    goto err;
+static int drm_crtc_sample_vblank(drm_ctx *ctx, drm_crtc *crtc)
+{
+  uint64_t time, period;
+  uint32_t seq, frames;
 
-  plane->cursor_plane = value == DRM_PLANE_TYPE_CURSOR;
-  if (plane->cursor_plane)
-    DRM_INFO("CRTC[%d]: using cursor plane\n", crtc->crtc_id);
+  if (drm_crtc_get_vblank(ctx, crtc, &seq, &time) < 0)
+    return -1;
 
-  if (ctx->prefer_afbc_modifier && plane->can_afbc)
-    crtc->use_afbc_modifier = 1;
-  else if (!plane->can_linear)
-    crtc->use_afbc_modifier = 1;
+  frames = seq - crtc->vblank_seq;
+  if (crtc->vblank_time && frames && time > crtc->vblank_time) {
+    period = (time - crtc->vblank_time) / frames;
+
+    /* Restart learning on mode changes, otherwise smooth it */
+    if (!crtc->vblank_period ||
+        period > crtc->vblank_period * 11 / 10 ||
+        period < crtc->vblank_period * 9 / 10)
+      crtc->vblank_period = period;
+    else
+      crtc->vblank_period = (crtc->vblank_period * 7 + period) / 8;
+  }
 
-  DRM_DEBUG("CRTC[%d]: bind plane: %d%s\n", crtc->crtc_id, plane->plane_id,
-            crtc->use_afbc_modifier ? "(AFBC)" : "");
+  crtc->vblank_seq = seq;
+  crtc->vblank_time = time;
 
-  crtc->plane = plane;
+  if (crtc->latch_measuring && crtc->vblank_period &&
+      (int32_t)(seq - crtc->latch_seq) >= 0)
+    drm_crtc_report_latch(crtc, seq, time);
 
   return 0;
-err:
-  drm_free_plane(plane);
-  return -1;
 }
 
-static int drm_crtc_valid(drm_crtc *crtc)
+static uint64_t drm_crtc_schedule_latch(drm_ctx *ctx, drm_crtc *crtc,
+                                        uint64_t now)
 {
-  return (crtc->width > 0 && crtc->height > 0) ? 0 : -1;
-}
+  uint64_t frames;
 
-static int drm_update_crtc(drm_ctx *ctx, drm_crtc *crtc)
-{
-  drmModeCrtcPtr c;
-  int was_connected, connected;
+  if (drm_crtc_sample_vblank(ctx, crtc) < 0 || !crtc->vblank_period)
+    return 0;
 
-  c = drmModeGetCrtc(ctx->fd, crtc->crtc_id);
-  if (!c)
-    return -1;
+  /* The first vblank that still leaves the margin */
+  frames = (now + ctx->latch_margin - crtc->vblank_time) /
+    crtc->vblank_period + 1;
 
-  was_connected = drm_crtc_valid(crtc) >= 0;
-  crtc->width = c->width;
-  crtc->height = c->height;
-  connected = drm_crtc_valid(crtc) >= 0;
+  crtc->latch_seq = crtc->vblank_seq + frames;
+  crtc->latch_vblank = crtc->vblank_time + frames * crtc->vblank_period;
+  return crtc->latch_vblank - ctx->latch_margin;
+}
 
-  drmModeFreeCrtc(c);
+static void drm_crtc_retry_commit(drm_ctx *ctx, drm_crtc *crtc)
+{
+  drm_plane *plane = crtc->plane;
+  drm_plane_update *update = &plane->batch;
 
-  if (connected != was_connected)
-    DRM_DEBUG("CRTC[%d]: %s!\n", crtc->crtc_id, \
-              connected ? "connected" : "disconnected");
+  DRM_DEBUG("CRTC[%d]: retry commit\n", crtc->crtc_id);
 
-  return drm_crtc_valid(crtc);
+  if (drm_set_plane(ctx, crtc, plane, update->fb,
+                    update->src_x, update->src_y,
+                    update->src_w, update->src_h,
+                    update->x, update->y, update->w, update->h))
+    DRM_ERROR("CRTC[%d]: failed to set plane (%d)\n", crtc->crtc_id, errno);
 }
 
-static int drm_crtc_update_offsets(drm_ctx *ctx, drm_crtc *crtc,
-                                   drm_cursor_state *cursor_state)
+static void drm_crtc_dispatch(drm_ctx *ctx, drm_crtc *crtc, uint64_t *deadline)
 {
-  int x, y, off_x, off_y, width, height, area_w, area_h;
-  float scale_x, scale_y;
+  uint64_t now, next_time;
+  int request, ret, latched = 0;
+
+  /* Tear down for switching fd, prepared again by the next calls */
+  if (atomic_load(&crtc->next_request) & REQ_RESET) {
+    DRM_DEBUG("CRTC[%d]: reset\n", crtc->crtc_id);
+    atomic_store(&crtc->next_request, 0);
+    goto error;
+  }
 
-  if (drm_update_crtc(ctx, crtc) < 0)
-    return -1;
+  if (!crtc->ready && drm_crtc_thread_init(ctx, crtc) < 0)
+    goto error;
 
-  width = cursor_state->width;
-  height = cursor_state->height;
+  now = drm_curr_time();
 
-  if (ctx->scale_from) {
-    scale_x = scale_y =
-      ctx->scale_from * crtc->width * crtc->height / width / height;
-  } else {
-    scale_x = ctx->scale_x ? ctx->scale_x : 1.0;
-    scale_y = ctx->scale_y ? ctx->scale_y : 1.0;
+  /* Keep pending requests coalescing until the last flip completed */
+  if (crtc->flip_fence >= 0) {
+    next_time = crtc->flip_time + DRM_FLIP_TIMEOUT;
+    if (now < next_time) {
+      drm_loop_update_deadline(deadline, next_time);
+      return;
+    }
+
+    DRM_DEBUG("CRTC[%d]: flip timeout\n", crtc->crtc_id);
+    drm_crtc_release_flip(crtc);
+    drm_crtc_release_retired(ctx, crtc);
   }
 
-  width *= scale_x;
-  height *= scale_y;
+  /* Keep new requests coalescing until the busy commit went through */
+  if (crtc->plane && crtc->plane->batched) {
+    if (now < crtc->commit_retry_time) {
+      drm_loop_update_deadline(deadline, crtc->commit_retry_time);
+      return;
+    }
 
-  x = cursor_state->x + cursor_state->hot_x - cursor_state->hot_x * scale_x;
-  y = cursor_state->y + cursor_state->hot_y - cursor_state->hot_y * scale_y;
-  area_w = crtc->width - width;
-  area_h = crtc->height - height;
+    /* Or retried with the other CRTCs' updates by the loop */
+    if (!crtc->loop->batch_req) {
+      drm_crtc_retry_commit(ctx, crtc);
+      if (crtc->plane->batched) {
+        drm_loop_update_deadline(deadline, crtc->commit_retry_time);
+        return;
+      }
 
-  off_x = off_y = 0;
+      /* Paced by the new flip */
+      if (crtc->flip_fence >= 0)
+        return;
 
-  if (x < 0)
-    off_x = x;
+      crtc->last_update_time = now;
+    }
+  }
 
-  if (y < 0)
-    off_y = y;
+  /* Step animated cursors by the frame durations */
+  if (crtc->anim_num) {
+    if (now < crtc->anim_time)
+      drm_loop_update_deadline(deadline, crtc->anim_time);
+    else
+      atomic_fetch_or_explicit(&crtc->next_request, REQ_ANIMATE,
+                               memory_order_relaxed);
+  }
 
-  if (x > area_w)
-    off_x = x - area_w;
+  if (!atomic_load_explicit(&crtc->next_request, memory_order_relaxed))
+    return;
 
-  if (y > area_h)
-    off_y = y - area_h;
+  /* Or until the interval elapsed without flip pacing */
+  if (!crtc->flip_pacing) {
+    next_time = crtc->last_update_time + ctx->min_interval;
+    if (now < next_time) {
+      drm_loop_update_deadline(deadline, next_time);
+      return;
+    }
+  }
 
-  cursor_state->scaled_x = x;
-  cursor_state->scaled_y = y;
-  cursor_state->off_x = off_x;
-  cursor_state->off_y = off_y;
-  cursor_state->scaled_w = width;
-  cursor_state->scaled_h = height;
+  /* Sleep until the margin before next vblank, then take the newest state */
+  if (ctx->latch_margin) {
+    if (!crtc->latch_time)
+      crtc->latch_time = drm_crtc_schedule_latch(ctx, crtc, now);
 
-  return 0;
-}
+    if (now < crtc->latch_time) {
+      drm_loop_update_deadline(deadline, crtc->latch_time);
+      return;
+    }
 
-#define drm_crtc_disable_cursor(ctx, crtc) \
-  drm_crtc_update_cursor(ctx, crtc, NULL)
+    latched = !!crtc->latch_time;
+    crtc->latch_time = 0;
+  }
 
-static int drm_crtc_update_cursor(drm_ctx *ctx, drm_crtc *crtc,
-                                  drm_cursor_state *cursor_state)
-{
-  drm_plane *plane = crtc->plane;
-  uint32_t old_fb = crtc->cursor_curr.fb;
-  uint32_t fb;
-  int x, y, w, h, ret;
+  crtc->last_update_time = now;
 
-  /* Disable */
-  if (!cursor_state) {
-    if (old_fb) {
-      DRM_DEBUG("CRTC[%d]: disabling cursor\n", crtc->crtc_id);
-      drm_set_plane(ctx, crtc, plane, 0, 0, 0, 0, 0);
-      drmModeRmFB(ctx->fd, old_fb);
-    }
+  request = atomic_exchange_explicit(&crtc->next_request, 0,
+                                     memory_order_acquire);
 
-    memset(&crtc->cursor_curr, 0, sizeof(drm_cursor_state));
-    return 0;
+  crtc->batching = !!crtc->loop->batch_req;
+  crtc->convert_busy = 0;
+  ret = drm_crtc_handle_request(ctx, crtc, request);
+  crtc->batching = 0;
+
+  /* Retry after the flip retired some buffers, keeping the current FB */
+  if (ret < 0 && crtc->convert_busy &&
+      crtc->convert_retries++ < DRM_MAX_CONVERT_RETRIES) {
+    /* Nothing else would release them */
+    if (crtc->flip_fence < 0)
+      drm_crtc_reclaim_fbs(ctx, crtc);
+
+    atomic_fetch_or_explicit(&crtc->next_request, request,
+                             memory_order_relaxed);
+    drm_loop_update_deadline(deadline, now + DRM_COMMIT_RETRY_TIME);
+    return;
   }
 
-  /* Unchanged */
-  if (crtc->cursor_curr.fb == cursor_state->fb &&
-      crtc->cursor_curr.scaled_x == cursor_state->scaled_x &&
-      crtc->cursor_curr.scaled_y == cursor_state->scaled_y &&
-      crtc->cursor_curr.off_x == cursor_state->off_x &&
-      crtc->cursor_curr.off_y == cursor_state->off_y) {
-    crtc->cursor_curr = *cursor_state;
-    return 0;
+  crtc->convert_retries = 0;
+
+  if (ret < 0) {
+    if (crtc->convert_busy)
+      DRM_ERROR("CRTC[%d]: no retired buffer to convert\n", crtc->crtc_id);
+    goto error;
   }
 
-  fb = cursor_state->fb;
-  x = cursor_state->scaled_x - cursor_state->off_x;
-  y = cursor_state->scaled_y - cursor_state->off_y;
-  w = cursor_state->scaled_w;
-  h = cursor_state->scaled_h;
+  if (latched) {
+    now = drm_curr_time();
+    crtc->latch_slack_sum += (int64_t)(crtc->latch_vblank - now);
+    if (now > crtc->latch_vblank)
+      crtc->latch_missed++;
+
+    /* Measure the phase error after the predicted vblank */
+    crtc->latch_measuring = 1;
+  }
+
+  return;
+error:
+  drm_crtc_thread_error(ctx, crtc);
+}
+
+/* Commit the CRTCs' deferred updates in one request, or each on failure */
+static void drm_loop_flush_commits(drm_ctx *ctx, drm_loop *loop)
+{
+  unsigned crtcs = atomic_load(&loop->crtcs);
+  uint64_t now = drm_curr_time();
+  drm_crtc *crtc;
+  drm_plane *plane;
+  int i, num = 0, ret = 0, busy = 0;
+
+  if (!loop->batch_req)
+    return;
 
-  DRM_DEBUG("CRTC[%d]: setting fb: %d (%dx%d) on plane: %d at (%d,%d)\n",
-            crtc->crtc_id, fb, w, h, plane->plane_id, x, y);
+  /* Skip the busy ones until retrying */
+  for (i = 0; i < ctx->num_crtcs; i++) {
+    crtc = &ctx->crtcs[i];
+    plane = crtc->plane;
+    if ((crtcs & (1u << i)) && plane && plane->batched &&
+        now < crtc->commit_retry_time)
+      crtcs &= ~(1u << i);
+  }
 
-  ret = drm_set_plane(ctx, crtc, plane, fb, x, y, w, h);
-  if (ret)
-    DRM_ERROR("CRTC[%d]: failed to set plane (%d)\n", crtc->crtc_id, errno);
+  drmModeAtomicSetCursor(loop->batch_req, 0);
+  for (i = 0; i < ctx->num_crtcs; i++) {
+    crtc = &ctx->crtcs[i];
+    plane = crtc->plane;
+    if (!(crtcs & (1u << i)) || !plane || !plane->batched)
+      continue;
 
-  if (old_fb && old_fb != fb) {
-    DRM_DEBUG("CRTC[%d]: remove FB: %d\n", crtc->crtc_id, old_fb);
-    drmModeRmFB(ctx->fd, old_fb);
+    if (drmModeAtomicMerge(loop->batch_req, plane->req) < 0)
+      ret = -1;
+    num++;
   }
 
-  crtc->cursor_curr = *cursor_state;
-  return ret;
-}
+  if (!num)
+    return;
 
-static int drm_crtc_create_fb(drm_ctx *ctx, drm_crtc *crtc,
-                              drm_cursor_state *cursor_state)
-{
-  uint32_t handle = cursor_state->handle;
-  int width = cursor_state->width;
-  int height = cursor_state->height;
-  int scaled_w = cursor_state->scaled_w;
-  int scaled_h = cursor_state->scaled_h;
-  int off_x = cursor_state->off_x;
-  int off_y = cursor_state->off_y;
+  if (!ret) {
+    ret = drm_real_atomic_commit(ctx->fd, loop->batch_req,
+                              DRM_MODE_ATOMIC_NONBLOCK, NULL);
+    busy = ret < 0 && DRM_COMMIT_TRANSIENT(errno);
+  }
 
-  DRM_DEBUG("CRTC[%d]: convert FB from %d (%dx%d) to (%dx%d) offset: (%d,%d)\n",
-            crtc->crtc_id, handle, width, height,
-            scaled_w, scaled_h, off_x, off_y);
+  if (ret < 0)
+    DRM_DEBUG("failed to commit %d CRTCs together (%d)\n", num, errno);
 
-  if (!crtc->egl_ctx) {
-    uint64_t modifier;
-    int format;
+  for (i = 0; i < ctx->num_crtcs; i++) {
+    drm_plane_update *update;
 
-    if (crtc->use_afbc_modifier) {
-      /* Mali only support AFBC with BGR formats now */
-      format = GBM_FORMAT_ABGR8888;
-      modifier = DRM_AFBC_MODIFIER;
-    } else {
-      format = GBM_FORMAT_ARGB8888;
-      modifier = 0;
+    crtc = &ctx->crtcs[i];
+    plane = crtc->plane;
+    if (!(crtcs & (1u << i)) || !plane || !plane->batched)
+      continue;
+
+    /* Hold back all of them, and retry together */
+    if (busy) {
+      crtc->commit_retry_time = now + DRM_COMMIT_RETRY_TIME;
+      continue;
     }
 
-    crtc->egl_ctx = egl_init_ctx(ctx->fd, ctx->num_surfaces, format, modifier);
-    if (!crtc->egl_ctx) {
-      DRM_ERROR("CRTC[%d]: failed to init egl ctx\n", crtc->crtc_id);
-      return -1;
+    plane->batched = 0;
+    update = &plane->batch;
+
+    if (ret >= 0) {
+      ctx->atomic_failures = 0;
+      drm_plane_committed(ctx, crtc, plane, update->fb, update->values,
+                          update->fenced);
+      continue;
     }
-  }
 
-  cursor_state->fb =
-    egl_convert_fb(ctx->fd, crtc->egl_ctx, handle, width, height,
-                   scaled_w, scaled_h, off_x, off_y);
-  if (!cursor_state->fb) {
-    DRM_ERROR("CRTC[%d]: failed to create FB\n", crtc->crtc_id);
-    return -1;
+    /* Retry each plane alone, which falls back as usual */
+    if (drm_set_plane(ctx, crtc, plane, update->fb,
+                      update->src_x, update->src_y,
+                      update->src_w, update->src_h,
+                      update->x, update->y, update->w, update->h))
+      DRM_ERROR("CRTC[%d]: failed to set plane (%d)\n",
+                crtc->crtc_id, errno);
   }
+}
 
-  DRM_DEBUG("CRTC[%d]: created FB: %d\n", crtc->crtc_id, cursor_state->fb);
-  return 0;
+static void drm_loop_set_timer(drm_loop *loop, uint64_t deadline)
+{
+  struct itimerspec its = { 0, };
+
+  if (deadline == loop->deadline)
+    return;
+
+  /* Zero disarms the timer */
+  its.it_value.tv_sec = deadline / NSEC_PER_SEC;
+  its.it_value.tv_nsec = deadline % NSEC_PER_SEC;
+  timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+  loop->deadline = deadline;
 }
 
-static void *drm_crtc_thread_fn(void *data)
+static void drm_loop_handle_event(drm_ctx *ctx, drm_loop *loop,
+                                  uint64_t data)
 {
-  drm_ctx *ctx = drm_get_ctx(-1);
-  drm_crtc *crtc = data;
-  drm_plane *plane = crtc->plane;
-  drm_cursor_state cursor_state;
-  uint64_t duration;
-  char name[256];
+  drm_crtc *crtc = &ctx->crtcs[LOOP_EVENT_IDX(data)];
+  uint64_t count;
+
+  switch (LOOP_EVENT_TYPE(data)) {
+  case LOOP_EVENT_REQUEST:
+    drm_crtc_drain_events(crtc);
+    break;
+  case LOOP_EVENT_FLIP:
+    drm_crtc_release_flip(crtc);
+    drm_crtc_release_retired(ctx, crtc);
+    if (crtc->latch_measuring)
+      drm_crtc_sample_vblank(ctx, crtc);
+    break;
+  case LOOP_EVENT_TIMER:
+    if (read(loop->timer_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      DRM_ERROR("failed to read timer (%d)\n", errno);
+    loop->deadline = 0;
+    break;
+  case LOOP_EVENT_UEVENT:
+    drm_handle_uevents(ctx);
+    break;
+  }
+}
 
-  DRM_DEBUG("CRTC[%d]: thread started\n", crtc->crtc_id);
+static void *drm_loop_thread_fn(void *data)
+{
+  drm_loop *loop = data;
+  drm_ctx *ctx = loop->ctx;
+  struct epoll_event events[DRM_MAX_CRTCS * 2 + 2];
+  uint64_t deadline;
+  unsigned crtcs;
+  char name[256];
+  int i, n;
 
   /**
    * The new DRM driver doesn't allow setting atomic cap for Xorg.
    * Let's use a custom thread name to workaround that.
    */
-  snprintf(name, sizeof(name), "drm-cursor[%d]", crtc->crtc_id);
-  pthread_setname_np(crtc->thread, name);
+  if (loop == ctx->loop)
+    snprintf(name, sizeof(name), "drm-cursor");
+  else
+    snprintf(name, sizeof(name), "drm-cursor[%d]", loop->crtc_id);
+  pthread_setname_np(loop->thread, name);
 
-  if (!plane->cursor_plane) {
-    drmSetClientCap(ctx->fd, DRM_CLIENT_CAP_ATOMIC, 1);
+  DRM_DEBUG("%s: thread started\n", name);
 
-    /* Reflush props with atomic cap enabled */
-    drmModeFreeObjectProperties(plane->props);
-    plane->props = drmModeObjectGetProperties(ctx->fd, plane->plane_id,
-                                              DRM_MODE_OBJECT_PLANE);
-    if (!plane->props)
-      goto error;
+  while (1) {
+    n = epoll_wait(loop->epoll_fd, events,
+                   sizeof(events) / sizeof(events[0]), -1);
+    if (n < 0 && errno != EINTR) {
+      DRM_ERROR("%s: failed to wait events (%d)\n", name, errno);
+      break;
+    }
 
-    /* Set maximum ZPOS */
-    drm_plane_set_prop_max(ctx, plane, PLANE_PROP_zpos);
-    drm_plane_set_prop_max(ctx, plane, PLANE_PROP_ZPOS);
+    for (i = 0; i < n; i++)
+      drm_loop_handle_event(ctx, loop, events[i].data.u64);
 
-    /* Set async commit for Rockchip BSP kernel */
-    crtc->async_commit =
-      !drm_plane_set_prop_max(ctx, plane, PLANE_PROP_ASYNC_COMMIT);
-    if (crtc->async_commit)
-      DRM_INFO("CRTC[%d]: using async commit\n", crtc->crtc_id);
+    /* Serve every CRTC of this loop, requests are latest-wins */
+    deadline = 0;
+    crtcs = atomic_load(&loop->crtcs);
+    for (i = 0; i < ctx->num_crtcs; i++) {
+      if (crtcs & (1u << i))
+        drm_crtc_dispatch(ctx, &ctx->crtcs[i], &deadline);
+    }
+
+    drm_loop_flush_commits(ctx, loop);
+    drm_loop_set_timer(loop, deadline);
+
+    /* The dedicated loop ends with its CRTC */
+    if (loop != ctx->loop && !atomic_load(&loop->crtcs))
+      break;
   }
 
-  crtc->last_update_time = drm_curr_time();
+  for (i = 0; i < ctx->num_crtcs; i++) {
+    if (atomic_load(&loop->crtcs) & (1u << i))
+      drm_crtc_thread_error(ctx, &ctx->crtcs[i]);
+  }
 
-  while (1) {
-    /* Wait for new cursor state */
-    pthread_mutex_lock(&crtc->mutex);
-    while (crtc->state != PENDING)
-      pthread_cond_wait(&crtc->cond, &crtc->mutex);
+  if (loop == ctx->loop)
+    ctx->loop = NULL;
 
-    cursor_state = crtc->cursor_next;
-    crtc->cursor_next.request = 0;
-    crtc->state = IDLE;
-    cursor_state.request |= crtc->cursor_curr.request; /* For retry */
-    pthread_mutex_unlock(&crtc->mutex);
+  if (loop->uevent)
+    atomic_fetch_sub(&ctx->uevent_loops, 1);
 
-    /* For edge moving */
-    if (drm_crtc_update_offsets(ctx, crtc, &cursor_state) < 0) {
-      DRM_DEBUG("CRTC[%d]: unavailable!\n", crtc->crtc_id);
-      drm_crtc_disable_cursor(ctx, crtc);
-      goto retry;
-    }
+  if (loop->batch_req)
+    drmModeAtomicFree(loop->batch_req);
 
-    if (cursor_state.request & REQ_SET_CURSOR) {
-      cursor_state.request = 0;
+  close(loop->timer_fd);
+  close(loop->epoll_fd);
+  free(loop);
+  return NULL;
+}
 
-      /* Handle set-cursor */
-      DRM_DEBUG("CRTC[%d]: set new cursor %d (%dx%d)\n",
-                crtc->crtc_id, cursor_state.handle,
-                cursor_state.width, cursor_state.height);
+static drm_loop *drm_loop_create(drm_crtc *crtc)
+{
+  struct epoll_event event = {
+    .events = EPOLLIN,
+    .data.u64 = LOOP_EVENT(LOOP_EVENT_TIMER, 0),
+  };
+  drm_loop *loop;
+
+  loop = calloc(1, sizeof(*loop));
+  if (!loop)
+    return NULL;
 
-      if (!cursor_state.handle) {
-        drm_crtc_disable_cursor(ctx, crtc);
-        goto next;
-      }
+  loop->crtc_id = crtc->crtc_id;
 
-      if (drm_crtc_create_fb(ctx, crtc, &cursor_state) < 0)
-        goto error;
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd < 0)
+    goto err_free;
 
-      if (drm_crtc_update_cursor(ctx, crtc, &cursor_state) < 0) {
-        DRM_ERROR("CRTC[%d]: failed to set cursor\n", crtc->crtc_id);
-        goto error;
-      }
-    } else if (cursor_state.request & REQ_MOVE_CURSOR) {
-      cursor_state.request = 0;
-
-      /* Handle move-cursor */
-      DRM_DEBUG("CRTC[%d]: move cursor to (%d[%d],%d[%d])\n",
-                crtc->crtc_id, cursor_state.scaled_x, -cursor_state.off_x,
-                cursor_state.scaled_y, -cursor_state.off_y);
-
-      if (!crtc->cursor_curr.handle) {
-        /* Pre-moving */
-        crtc->cursor_curr = cursor_state;
-        goto next;
-      } else if (crtc->cursor_curr.off_x != cursor_state.off_x ||
-                 crtc->cursor_curr.off_y != cursor_state.off_y) {
-        /* Edge moving */
-        if (drm_crtc_create_fb(ctx, crtc, &cursor_state) < 0)
-          goto error;
-      } else {
-        /* Normal moving */
-        cursor_state.fb = crtc->cursor_curr.fb;
-      }
+  loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (loop->timer_fd < 0)
+    goto err_close_epoll;
 
-      if (drm_crtc_update_cursor(ctx, crtc, &cursor_state) < 0) {
-        DRM_ERROR("CRTC[%d]: failed to move cursor\n", crtc->crtc_id);
-        goto error;
-      }
-    }
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->timer_fd, &event) < 0)
+    goto err_close_timer;
 
-    if (!crtc->verified && crtc->cursor_curr.fb) {
-      pthread_mutex_lock(&crtc->mutex);
-      DRM_INFO("CRTC[%d]: it works!\n", crtc->crtc_id);
-      crtc->verified = 1;
-      pthread_cond_signal(&crtc->cond);
-      pthread_mutex_unlock(&crtc->mutex);
-    }
+  return loop;
+err_close_timer:
+  close(loop->timer_fd);
+err_close_epoll:
+  close(loop->epoll_fd);
+err_free:
+  free(loop);
+  return NULL;
+}
 
-next:
-    duration = drm_curr_time() - crtc->last_update_time;
-    if (duration < ctx->min_interval)
-      usleep((ctx->min_interval - duration) * 1000);
-    crtc->last_update_time = drm_curr_time();;
-    continue;
-retry:
-    /* Force setting cursor in next request */
-    pthread_mutex_lock(&crtc->mutex);
-    crtc->cursor_curr.request = REQ_SET_CURSOR;
-    pthread_cond_signal(&crtc->cond);
-    pthread_mutex_unlock(&crtc->mutex);
-    goto next;
+static drm_loop *drm_loop_add_crtc(drm_ctx *ctx, drm_crtc *crtc)
+{
+  struct epoll_event event = {
+    .events = EPOLLIN,
+    .data.u64 = LOOP_EVENT(LOOP_EVENT_REQUEST, crtc - ctx->crtcs),
+  };
+  drm_loop *loop = ctx->single_thread ? ctx->loop : NULL;
+  int new_loop = !loop;
+
+  if (new_loop) {
+    loop = drm_loop_create(crtc);
+    if (!loop)
+      return NULL;
+
+    loop->ctx = ctx;
+
+    if (ctx->batch_commits)
+      loop->batch_req = drmModeAtomicAlloc();
+
+    /* Shared by the loops, any of them would drain it */
+    if (ctx->uevent_fd >= 0) {
+      struct epoll_event uevent = {
+        .events = EPOLLIN,
+        .data.u64 = LOOP_EVENT(LOOP_EVENT_UEVENT, 0),
+      };
+
+      if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, ctx->uevent_fd,
+                    &uevent) < 0) {
+        DRM_ERROR("failed to watch uevents (%d)\n", errno);
+      } else {
+        loop->uevent = 1;
+      }
+    }
   }
 
-error:
-  if (crtc->egl_ctx) {
-    egl_free_ctx(crtc->egl_ctx);
-    crtc->egl_ctx = NULL;
-  }
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, crtc->event_fd, &event) < 0)
+    goto err;
 
-  drm_crtc_disable_cursor(ctx, crtc);
+  atomic_fetch_or(&loop->crtcs, 1u << (crtc - ctx->crtcs));
 
-  pthread_mutex_lock(&crtc->mutex);
-  DRM_DEBUG("CRTC[%d]: thread error\n", crtc->crtc_id);
-  crtc->state = FATAL_ERROR;
+  if (!new_loop)
+    return loop;
 
-  if (crtc->plane) {
-    drm_free_plane(crtc->plane);
-    crtc->plane = NULL;
+  if (ctx->single_thread)
+    ctx->loop = loop;
+
+  if (pthread_create(&loop->thread, NULL, drm_loop_thread_fn, loop)) {
+    ctx->loop = NULL;
+    goto err;
   }
 
-  pthread_cond_signal(&crtc->cond);
-  pthread_mutex_unlock(&crtc->mutex);
+  pthread_detach(loop->thread);
 
+  if (loop->uevent)
+    atomic_fetch_add(&ctx->uevent_loops, 1);
+
+  return loop;
+err:
+  if (new_loop) {
+    if (loop->batch_req)
+      drmModeAtomicFree(loop->batch_req);
+    close(loop->timer_fd);
+    close(loop->epoll_fd);
+    free(loop);
+  }
   return NULL;
 }
 
@@ -1103,6 +3580,11 @@ static int drm_crtc_prepare(drm_ctx *ctx, drm_crtc *crtc)
   if (crtc->prefer_plane_id)
     drm_crtc_bind_plane_force(ctx, crtc, crtc->prefer_plane_id);
 
+  /* Try the plane chosen last time */
+  if (!crtc->plane && crtc->cached_plane_id)
+    drm_crtc_bind_plane(ctx, crtc, crtc->cached_plane_id,
+                        ctx->allow_overlay);
+
   /* Try cursor plane */
   for (i = 0; !crtc->plane && i < ctx->pres->count_planes; i++)
     drm_crtc_bind_plane_cursor(ctx, crtc, ctx->pres->planes[i]);
@@ -1118,13 +3600,39 @@ static int drm_crtc_prepare(drm_ctx *ctx, drm_crtc *crtc)
     return -1;
   }
 
+  if (crtc->cached_plane_id != crtc->plane->plane_id) {
+    crtc->cached_plane_id = crtc->plane->plane_id;
+    drm_cache_save(ctx);
+  }
+
+  if (crtc->event_fd < 0) {
+    crtc->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (crtc->event_fd < 0) {
+      DRM_ERROR("CRTC[%d]: failed to create eventfd\n", crtc->crtc_id);
+      goto err;
+    }
+  }
+
   crtc->state = IDLE;
+  crtc->ready = 0;
 
   pthread_cond_init(&crtc->cond, NULL);
   pthread_mutex_init(&crtc->mutex, NULL);
-  pthread_create(&crtc->thread, NULL, drm_crtc_thread_fn, crtc);
 
+  /* The loop serves the CRTC from now on */
+  crtc->loop = drm_loop_add_crtc(ctx, crtc);
+  if (!crtc->loop) {
+    DRM_ERROR("CRTC[%d]: failed to add to loop\n", crtc->crtc_id);
+    goto err;
+  }
+
+  /* Kick the loop to init the CRTC */
+  drm_crtc_post_request(crtc, 0);
   return 0;
+err:
+  drm_free_plane(crtc->plane);
+  crtc->plane = NULL;
+  return -1;
 }
 
 static drm_crtc *drm_get_crtc(drm_ctx *ctx, uint32_t crtc_id)
@@ -1152,25 +3660,168 @@ static drm_crtc *drm_get_crtc(drm_ctx *ctx, uint32_t crtc_id)
   return crtc;
 }
 
+/**
+ * Switch to the client's new fd, after stopping the threads and backends
+ * using the old one. The cursors are set again by the client.
+ * Only called when setting cursors, moving never blocks on it.
+ */
+static void drm_switch_fd(drm_ctx *ctx)
+{
+  int i, fd;
+
+  if (atomic_load_explicit(&ctx->pending_fd, memory_order_relaxed) < 0)
+    return;
+
+  fd = atomic_exchange(&ctx->pending_fd, -1);
+  if (fd < 0)
+    return;
+
+  DRM_INFO("switching to new fd\n");
+
+  for (i = 0; i < ctx->num_crtcs; i++) {
+    drm_crtc *crtc = &ctx->crtcs[i];
+
+    /* Never prepared */
+    if (crtc->event_fd < 0)
+      continue;
+
+    pthread_mutex_lock(&crtc->mutex);
+    if (crtc->loop) {
+      crtc->resetting = 1;
+      drm_crtc_post_request(crtc, REQ_RESET);
+      while (crtc->state != FATAL_ERROR)
+        pthread_cond_wait(&crtc->cond, &crtc->mutex);
+    }
+
+    /* Verified again on the new fd, leaving the hardware cursor fallback */
+    crtc->state = IDLE;
+    crtc->resetting = 0;
+    crtc->verified = 0;
+    crtc->hw_cursor = 0;
+    pthread_mutex_unlock(&crtc->mutex);
+  }
+
+  close(ctx->fd);
+  ctx->fd = fd;
+
+  drmSetClientCap(ctx->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+}
+
+/**
+ * Bind planes and start threads for the active CRTCs, once. Tried again by
+ * the next calls when none was active.
+ */
+static void drm_prewarm(drm_ctx *ctx)
+{
+  int i, num = 0;
+
+  if (!atomic_exchange(&ctx->prewarm, 0))
+    return;
+
+  for (i = 0; i < ctx->num_crtcs; i++) {
+    drm_crtc *crtc = &ctx->crtcs[i];
+
+    if (crtc->blocked || crtc->plane || drm_update_crtc(ctx, crtc) < 0)
+      continue;
+
+    DRM_INFO("CRTC[%d]: prewarming cursor\n", crtc->crtc_id);
+
+    crtc->prewarm = 1;
+    if (drm_crtc_prepare(ctx, crtc) < 0)
+      DRM_ERROR("CRTC[%d]: failed to prewarm\n", crtc->crtc_id);
+
+    num++;
+  }
+
+  if (!num)
+    atomic_store(&ctx->prewarm, 1);
+}
+
+/* The real libdrm APIs, for falling back to hardware cursors */
+static int drm_real_set_cursor(int fd, uint32_t crtc_id, uint32_t handle,
+                               uint32_t width, uint32_t height,
+                               int hot_x, int hot_y)
+{
+  static int (*set_cursor2)(int, uint32_t, uint32_t, uint32_t, uint32_t,
+                            int32_t, int32_t);
+
+  if (!set_cursor2)
+    *(void **)&set_cursor2 = dlsym(RTLD_NEXT, "drmModeSetCursor2");
+  if (!set_cursor2) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  return set_cursor2(fd, crtc_id, handle, width, height, hot_x, hot_y);
+}
+
+static int drm_real_move_cursor(int fd, uint32_t crtc_id, int x, int y)
+{
+  static int (*move_cursor)(int, uint32_t, int, int);
+
+  if (!move_cursor)
+    *(void **)&move_cursor = dlsym(RTLD_NEXT, "drmModeMoveCursor");
+  if (!move_cursor) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  return move_cursor(fd, crtc_id, x, y);
+}
+
+/**
+ * In async mode, hand the CRTC failed in the background back to the real
+ * hardware cursor, restoring the latest cursor there.
+ */
+static int drm_crtc_check_hw_cursor(drm_ctx *ctx, drm_crtc *crtc, int fd)
+{
+  drm_cursor_state cursor_state;
+
+  if (crtc->hw_cursor)
+    return 1;
+
+  if (!ctx->async_set || crtc->state != FATAL_ERROR || crtc->resetting)
+    return 0;
+
+  DRM_ERROR("CRTC[%d]: failed, falling back to hardware cursor\n",
+            crtc->crtc_id);
+  crtc->hw_cursor = 1;
+
+  drm_crtc_read_next(crtc, &cursor_state);
+  drm_real_set_cursor(fd, crtc->crtc_id, cursor_state.handle,
+                      cursor_state.width, cursor_state.height,
+                      cursor_state.hot_x, cursor_state.hot_y);
+  drm_real_move_cursor(fd, crtc->crtc_id, cursor_state.x, cursor_state.y);
+  return 1;
+}
+
 static int drm_set_cursor(int fd, uint32_t crtc_id, uint32_t handle,
                           uint32_t width, uint32_t height,
-                          int hot_x, int hot_y)
+                          int hot_x, int hot_y,
+                          const drmModeCursorFrame *frames, int num_frames)
 {
   drm_crtc *crtc;
   drm_ctx *ctx;
-  drm_cursor_state *cursor_next;
+  int i;
 
-  ctx = drm_get_ctx(fd);
+  ctx = drm_get_ctx(fd, 1);
   if (!ctx)
     return -1;
 
   if (ctx->hide)
     return 0;
 
+  drm_switch_fd(ctx);
+  drm_prewarm(ctx);
+
   crtc = drm_get_crtc(ctx, crtc_id);
   if (!crtc)
     return -1;
 
+  if (drm_crtc_check_hw_cursor(ctx, crtc, fd))
+    return drm_real_set_cursor(fd, crtc->crtc_id, handle, width, height,
+                               hot_x, hot_y);
+
   if (drm_crtc_prepare(ctx, crtc) < 0)
     return -1;
 
@@ -1184,28 +3835,29 @@ static int drm_set_cursor(int fd, uint32_t crtc_id, uint32_t handle,
     return -1;
   }
 
-  /* Update next cursor state and notify the thread */
-  cursor_next = &crtc->cursor_next;
+  /* Frames of animated cursors, taken by the thread with the request */
+  crtc->anim_pending_num = num_frames;
+  for (i = 0; i < num_frames; i++) {
+    drm_anim_frame *frame = &crtc->anim_pending[i];
 
-  crtc->cursor_curr.request = 0;
-  cursor_next->request = REQ_SET_CURSOR;
+    memset(frame, 0, sizeof(*frame));
+    frame->handle = frames[i].bo_handle;
+    frame->duration = frames[i].duration_ms * NSEC_PER_MSEC;
+  }
 
-  cursor_next->fb = 0;
-  cursor_next->handle = handle;
-  cursor_next->width = width;
-  cursor_next->height = height;
-  cursor_next->hot_x = hot_x;
-  cursor_next->hot_y = hot_y;
-  crtc->state = PENDING;
-  pthread_cond_signal(&crtc->cond);
+  /* Update next cursor state and notify the thread */
+  crtc->set_deferred = 0;
+  drm_crtc_write_next(crtc, handle, width, height, hot_x, hot_y);
+  drm_crtc_post_request(crtc, REQ_SET_CURSOR);
 
-  if (handle) {
+  /* Verified in the background, failures are handled by the next calls */
+  if (handle && !ctx->async_set) {
     /**
      * Wait for verified or fatal error or retry.
      * HACK: Fake retry as successed.
      */
     while (!crtc->verified && crtc->state != FATAL_ERROR && \
-           !crtc->cursor_curr.request)
+           !crtc->set_deferred)
       pthread_cond_wait(&crtc->cond, &crtc->mutex);
   }
 
@@ -1223,19 +3875,23 @@ static int drm_move_cursor(int fd, uint32_t crtc_id, int x, int y)
 {
   drm_ctx *ctx;
   drm_crtc *crtc;
-  drm_cursor_state *cursor_next;
 
-  ctx = drm_get_ctx(fd);
+  ctx = drm_get_ctx(fd, 0);
   if (!ctx)
     return -1;
 
   if (ctx->hide)
     return 0;
 
+  drm_prewarm(ctx);
+
   crtc = drm_get_crtc(ctx, crtc_id);
   if (!crtc)
     return -1;
 
+  if (drm_crtc_check_hw_cursor(ctx, crtc, fd))
+    return drm_real_move_cursor(fd, crtc->crtc_id, x, y);
+
   if (crtc->state == FATAL_ERROR || drm_crtc_prepare(ctx, crtc) < 0)
     return -1;
 
@@ -1245,22 +3901,10 @@ static int drm_move_cursor(int fd, uint32_t crtc_id, int x, int y)
   DRM_DEBUG("CRTC[%d]: request moving cursor to (%d,%d) in (%dx%d)\n",
             crtc->crtc_id, x, y, crtc->width, crtc->height);
 
-  pthread_mutex_lock(&crtc->mutex);
-  if (crtc->state == FATAL_ERROR) {
-    pthread_mutex_unlock(&crtc->mutex);
-    return -1;
-  }
-
-  /* Update next cursor state and notify the thread */
-  cursor_next = &crtc->cursor_next;
-
-  cursor_next->request |= REQ_MOVE_CURSOR;
-  cursor_next->fb = 0;
-  cursor_next->x = x;
-  cursor_next->y = y;
-  crtc->state = PENDING;
-  pthread_cond_signal(&crtc->cond);
-  pthread_mutex_unlock(&crtc->mutex);
+  /* Update next cursor position and notify the thread, lock-free */
+  atomic_store_explicit(&crtc->next_pos, DRM_CURSOR_POS(x, y),
+                        memory_order_relaxed);
+  drm_crtc_post_request(crtc, REQ_MOVE_CURSOR);
 
   return 0;
 }
@@ -1272,11 +3916,12 @@ int drmModeSetCursor2(int fd, uint32_t crtcId, uint32_t bo_handle,
                       int32_t hot_x, int32_t hot_y)
 {
   /* Init log file */
-  drm_get_ctx(fd);
+  drm_get_ctx(fd, 0);
 
   DRM_DEBUG("fd: %d crtc: %d handle: %d size: %dx%d (%d, %d)\n",
             fd, crtcId, bo_handle, width, height, hot_x, hot_y);
-  return drm_set_cursor(fd, crtcId, bo_handle, width, height, hot_x, hot_y);
+  return drm_set_cursor(fd, crtcId, bo_handle, width, height, hot_x, hot_y,
+                        NULL, 0);
 }
 
 int drmModeSetCursor(int fd, uint32_t crtcId, uint32_t bo_handle,
@@ -1284,7 +3929,7 @@ int drmModeSetCursor(int fd, uint32_t crtcId, uint32_t bo_handle,
 {
   drm_ctx *ctx;
 
-  ctx = drm_get_ctx(fd);
+  ctx = drm_get_ctx(fd, 0);
   if (!ctx)
     return -1;
 
@@ -1296,7 +3941,8 @@ int drmModeSetCursor(int fd, uint32_t crtcId, uint32_t bo_handle,
     DRM_INFO("CRTC[%d]: scaling without hotspots, use drmModeSetCursor2()!\n",
              crtcId);
 
-  return drm_set_cursor(fd, crtcId, bo_handle, width, height, 0, 0);
+  return drm_set_cursor(fd, crtcId, bo_handle, width, height, 0, 0,
+                        NULL, 0);
 }
 
 int drmModeMoveCursor(int fd, uint32_t crtcId, int x, int y)
@@ -1304,3 +3950,92 @@ int drmModeMoveCursor(int fd, uint32_t crtcId, int x, int y)
   DRM_DEBUG("fd: %d crtc: %d position: %d,%d\n", fd, crtcId, x, y);
   return drm_move_cursor(fd, crtcId, x, y);
 }
+
+int drmModeSetCursorAnimation(int fd, uint32_t crtcId,
+                              const drmModeCursorFrame *frames,
+                              uint32_t num_frames,
+                              uint32_t width, uint32_t height,
+                              int32_t hot_x, int32_t hot_y)
+{
+  uint32_t i;
+
+  /* Init log file */
+  drm_get_ctx(fd, 0);
+
+  DRM_DEBUG("fd: %d crtc: %d frames: %d size: %dx%d (%d, %d)\n",
+            fd, crtcId, num_frames, width, height, hot_x, hot_y);
+
+  if (!frames || !num_frames || num_frames > DRM_MAX_ANIM_FRAMES) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < num_frames; i++) {
+    if (!frames[i].bo_handle || !frames[i].duration_ms) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+
+  /* Nothing to animate */
+  if (num_frames == 1)
+    num_frames = 0;
+
+  return drm_set_cursor(fd, crtcId, frames[0].bo_handle, width, height,
+                        hot_x, hot_y, frames, num_frames);
+}
+
+/* Modeset hooks, the CRTC modes might be changed by them */
+
+static void drm_invalidate_modes(void)
+{
+  int i;
+
+  pthread_mutex_lock(&g_drm_mutex);
+  for (i = 0; i < DRM_MAX_DEVICES && g_drm_ctxs[i]; i++)
+    atomic_fetch_add(&g_drm_ctxs[i]->mode_gen, 1);
+  pthread_mutex_unlock(&g_drm_mutex);
+}
+
+/* Prewarm once the client lit up CRTCs, usually long before any cursor */
+static void drm_modeset_prewarm(int fd)
+{
+  drm_ctx *ctx = drm_get_ctx(fd, 0);
+
+  if (ctx && !ctx->hide)
+    drm_prewarm(ctx);
+}
+
+int drmModeSetCrtc(int fd, uint32_t crtcId, uint32_t bufferId,
+                   uint32_t x, uint32_t y, uint32_t *connectors, int count,
+                   drmModeModeInfoPtr mode)
+{
+  static int (*set_crtc)(int, uint32_t, uint32_t, uint32_t, uint32_t,
+                         uint32_t *, int, drmModeModeInfoPtr);
+  int ret;
+
+  if (!set_crtc)
+    *(void **)&set_crtc = dlsym(RTLD_NEXT, "drmModeSetCrtc");
+  if (!set_crtc) {
+    errno = ENOSYS;
+    return -1;
+  }
+
+  ret = set_crtc(fd, crtcId, bufferId, x, y, connectors, count, mode);
+  drm_invalidate_modes();
+  drm_modeset_prewarm(fd);
+  return ret;
+}
+
+int drmModeAtomicCommit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+                        void *user_data)
+{
+  int ret;
+
+  ret = drm_real_atomic_commit(fd, req, flags, user_data);
+  if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET) {
+    drm_invalidate_modes();
+    drm_modeset_prewarm(fd);
+  }
+  return ret;
+}
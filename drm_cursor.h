@@ -0,0 +1,47 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#ifndef __DRM_CURSOR_H_
+#define __DRM_CURSOR_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A frame of animated cursors */
+typedef struct {
+  uint32_t bo_handle;
+  uint32_t duration_ms;
+} drmModeCursorFrame;
+
+#define DRM_CURSOR_MAX_FRAMES 32
+
+/**
+ * Set an animated cursor, with frames of the same size and hotspot.
+ * The frames are converted once, and cycled by the library until replaced
+ * by another cursor. The BOs should stay alive until then.
+ */
+int drmModeSetCursorAnimation(int fd, uint32_t crtcId,
+                              const drmModeCursorFrame *frames,
+                              uint32_t num_frames,
+                              uint32_t width, uint32_t height,
+                              int32_t hot_x, int32_t hot_y);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -14,8 +14,13 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <drm.h>
 #include <xf86drm.h>
@@ -27,13 +32,20 @@
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
 
+#include "drm_backend.h"
 #include "drm_common.h"
 #include "drm_egl.h"
 
 #define EGL_LOAD_PROC(val, type, func) \
   do { val = (type) eglGetProcAddress(func); } while (0)
 
-static const GLfloat texcoords[] = {
+/* Quad positions followed by texcoords, uploaded into a VBO */
+static const GLfloat vertices[] = {
+  -1.0f, -1.0f,
+   1.0f, -1.0f,
+  -1.0f,  1.0f,
+   1.0f,  1.0f,
+
   0.0f,  1.0f,
   1.0f,  1.0f,
   0.0f,  0.0f,
@@ -43,10 +55,11 @@ static const GLfloat texcoords[] = {
 static const char vertex_shader_source[] =
 "attribute vec4 position;\n"
 "attribute vec2 texcoord;\n"
+"attribute vec2 offset;\n"
 "varying vec2 v_texcoord;\n"
 "void main()\n"
 "{\n"
-"   gl_Position = position;\n"
+"   gl_Position = position + vec4(offset, 0.0, 0.0);\n"
 "   v_texcoord = texcoord;\n"
 "}\n";
 
@@ -60,18 +73,149 @@ static const char fragment_shader_source[] =
 "    gl_FragColor = texture2D(tex, v_texcoord);\n"
 "}\n";
 
-/* HACK: use multiple surfaces to avoid AFBC corruption */
+/**
+ * HACK: use multiple surfaces to avoid AFBC corruption, when unable to
+ * sync with the display
+ */
 #define MAX_NUM_SURFACES 64
 
+/**
+ * With EGL_ANDROID_native_fence_sync, a single surface's buffers form a
+ * ring, each one locked until the display retires its FB.
+ */
+#define MAX_KEPT_BOS 4
+
+/* Leave enough free buffers in each surface for rendering */
+#define MAX_CACHED_BOS 2
+
+/**
+ * The fence synced ring has a single surface, so cached FBs get their own
+ * surfaces instead, each rendered once. As many as a CRTC's FB cache.
+ */
+#define MAX_CACHED_BOS_SYNCED 16
+
 typedef struct {
-  struct gbm_device *gbm_dev;
+  struct gbm_bo *bo;
+  uint32_t fb;
+
+  /* Kept for cached FB, otherwise until retired */
+  int cached;
+} egl_kept_bo;
+
+typedef struct {
+  struct gbm_surface *gbm_surface;
+  EGLSurface egl_surface;
+  struct gbm_bo *bo;
+  uint32_t fb;
+} egl_cached_bo;
+
+/* Pool of surfaces in size buckets, reused across resizes */
+#define MAX_NUM_BUCKETS 4
+#define BUCKET_ALIGN 64
+
+/* Surfaces of a bucket, rendering at the top-left corner */
+typedef struct {
+  int width;
+  int height;
+
   struct gbm_surface *gbm_surfaces[MAX_NUM_SURFACES];
+  EGLSurface egl_surfaces[MAX_NUM_SURFACES];
+
+  /* Front buffers kept from reusing */
+  egl_kept_bo kept_bos[MAX_NUM_SURFACES][MAX_KEPT_BOS];
+
+  /* Standalone buffers of cached FBs, with fence sync */
+  egl_cached_bo cached_bos[MAX_CACHED_BOS_SYNCED];
+
+  int current_surface;
+  uint64_t last_used;
+} egl_bucket;
+
+/* Imported client BOs stay resident until replaced by new cursors */
+#define MAX_NUM_SOURCES 4
+
+typedef struct {
+  uint32_t handle;
+  int width;
+  int height;
+
+  EGLImageKHR image;
+  GLuint texture;
+  uint64_t last_used;
+} egl_source;
+
+static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d = NULL;
+static PFNEGLCREATEIMAGEKHRPROC create_image = NULL;
+static PFNEGLDESTROYIMAGEKHRPROC destroy_image = NULL;
+static PFNEGLCREATESYNCKHRPROC create_sync = NULL;
+static PFNEGLDESTROYSYNCKHRPROC destroy_sync = NULL;
+static PFNEGLDUPNATIVEFENCEFDANDROIDPROC dup_native_fence_fd = NULL;
+static PFNGLGETPROGRAMBINARYOESPROC get_program_binary = NULL;
+static PFNGLPROGRAMBINARYOESPROC program_binary = NULL;
+
+/* Linked program binary cache, invalid when the driver or shaders changed */
+#define EGL_PROGRAM_CACHE_MAGIC 0x50435244 /* "DRCP" */
+#define EGL_PROGRAM_CACHE_VERSION 1
+#define EGL_PROGRAM_CACHE_MAX_SIZE (4 << 20)
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t source_hash;
+  char vendor[64];
+  char renderer[128];
+  char gl_version[128];
+  uint32_t format;
+  uint32_t size;
+} egl_program_cache_header;
+
+typedef struct {
+  GLuint vertex_shader, fragment_shader, program;
+  GLuint vbo;
+} egl_program;
+
+/**
+ * GBM device, EGL display and program shared by all CRTCs of a DRM fd.
+ * The CRTCs' contexts share objects with the device's context, which is
+ * only current when creating or destroying the program.
+ */
+#define MAX_NUM_DEVICES 4
+
+typedef struct {
+  int fd;
+  int refcnt;
+
+  struct gbm_device *gbm_dev;
+  EGLDisplay egl_display;
+  EGLContext egl_context;
+  egl_program program;
+
+  int fence_sync;
+} egl_device;
+
+static egl_device devices[MAX_NUM_DEVICES];
+static pthread_mutex_t devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct {
+  egl_device *dev;
+  struct gbm_device *gbm_dev;
 
   EGLDisplay egl_display;
   EGLContext egl_context;
   EGLConfig egl_config;
-  EGLSurface egl_surfaces[MAX_NUM_SURFACES];
-  GLuint vertex_shader, fragment_shader, program;
+
+  /* The device's program, or its own when unable to share */
+  egl_program *program;
+  egl_program own_program;
+  GLint offset_attrib;
+
+  egl_source sources[MAX_NUM_SOURCES];
+  uint64_t source_tick;
+
+  egl_bucket buckets[MAX_NUM_BUCKETS];
+  egl_bucket *bucket;
+  uint64_t bucket_tick;
+  uint32_t pool_size; /* 0 for exact sized surfaces */
 
   int width;
   int height;
@@ -79,115 +223,690 @@ typedef struct {
   int format;
   uint64_t modifier;
 
-  int current_surface;
   int num_surfaces;
+
+  /* Render fences, exported by EGL_ANDROID_native_fence_sync */
+  int fence_sync;
+  int fence;
 } egl_ctx;
 
+static void egl_release_kept_bos(egl_bucket *bucket, int surface)
+{
+  int i;
+
+  /* The FBs still hold the buffers, which would never be rendered again */
+  for (i = 0; i < MAX_KEPT_BOS; i++) {
+    egl_kept_bo *kept = &bucket->kept_bos[surface][i];
+
+    if (kept->bo)
+      gbm_surface_release_buffer(bucket->gbm_surfaces[surface], kept->bo);
+
+    memset(kept, 0, sizeof(*kept));
+  }
+}
+
+static void egl_destroy_cached_bo(egl_ctx *ctx, egl_cached_bo *cached)
+{
+  /* The FB still holds the buffer */
+  if (cached->bo)
+    gbm_surface_release_buffer(cached->gbm_surface, cached->bo);
+
+  if (cached->egl_surface != EGL_NO_SURFACE)
+    eglDestroySurface(ctx->egl_display, cached->egl_surface);
+
+  if (cached->gbm_surface)
+    gbm_surface_destroy(cached->gbm_surface);
+
+  memset(cached, 0, sizeof(*cached));
+  cached->egl_surface = EGL_NO_SURFACE;
+}
+
+/* Should be called without current surfaces */
+static void egl_destroy_bucket(egl_ctx *ctx, egl_bucket *bucket)
+{
+  int i;
+
+  for (i = 0; i < MAX_CACHED_BOS_SYNCED; i++)
+    egl_destroy_cached_bo(ctx, &bucket->cached_bos[i]);
+
+  for (i = 0; i < ctx->num_surfaces; i++) {
+    if (bucket->egl_surfaces[i] != EGL_NO_SURFACE)
+      eglDestroySurface(ctx->egl_display, bucket->egl_surfaces[i]);
+
+    if (bucket->gbm_surfaces[i]) {
+      egl_release_kept_bos(bucket, i);
+      gbm_surface_destroy(bucket->gbm_surfaces[i]);
+    }
+  }
+
+  memset(bucket, 0, sizeof(*bucket));
+  for (i = 0; i < MAX_NUM_SURFACES; i++)
+    bucket->egl_surfaces[i] = EGL_NO_SURFACE;
+
+  for (i = 0; i < MAX_CACHED_BOS_SYNCED; i++)
+    bucket->cached_bos[i].egl_surface = EGL_NO_SURFACE;
+
+  if (ctx->bucket == bucket)
+    ctx->bucket = NULL;
+}
+
+static void egl_free_source(egl_ctx *ctx, egl_source *src)
+{
+  if (src->texture)
+    glDeleteTextures(1, &src->texture);
+
+  if (src->image != EGL_NO_IMAGE_KHR)
+    destroy_image(ctx->egl_display, src->image);
+
+  memset(src, 0, sizeof(*src));
+  src->image = EGL_NO_IMAGE_KHR;
+}
+
+static void egl_free_program(egl_program *program)
+{
+  if (program->vbo)
+    glDeleteBuffers(1, &program->vbo);
+
+  if (program->program)
+    glDeleteProgram(program->program);
+
+  if (program->fragment_shader)
+    glDeleteShader(program->fragment_shader);
+
+  if (program->vertex_shader)
+    glDeleteShader(program->vertex_shader);
+
+  memset(program, 0, sizeof(*program));
+}
+
+/* Should be called with devices_mutex locked */
+static void egl_destroy_device(egl_device *dev)
+{
+  DRM_DEBUG("destroy EGL device of fd: %d\n", dev->fd);
+
+  if (dev->egl_display != EGL_NO_DISPLAY) {
+    if (dev->egl_context != EGL_NO_CONTEXT) {
+      eglMakeCurrent(dev->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                     dev->egl_context);
+      egl_free_program(&dev->program);
+      eglMakeCurrent(dev->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                     EGL_NO_CONTEXT);
+
+      eglDestroyContext(dev->egl_display, dev->egl_context);
+    }
+
+    eglTerminate(dev->egl_display);
+    eglReleaseThread();
+  }
+
+  if (dev->gbm_dev)
+    gbm_device_destroy(dev->gbm_dev);
+
+  memset(dev, 0, sizeof(*dev));
+}
+
+static void egl_put_device(egl_device *dev)
+{
+  pthread_mutex_lock(&devices_mutex);
+
+  if (--dev->refcnt <= 0)
+    egl_destroy_device(dev);
+
+  pthread_mutex_unlock(&devices_mutex);
+}
+
 drm_private void egl_free_ctx(void *data)
 {
   egl_ctx *ctx = data;
   int i;
 
-  if (ctx->egl_display != EGL_NO_DISPLAY) {
+  if (ctx->egl_context != EGL_NO_CONTEXT) {
+    /* GL objects are freed in the context */
     eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-                   EGL_NO_CONTEXT);
+                   ctx->egl_context);
 
-    if (ctx->program)
-      glDeleteProgram(ctx->program);
+    for (i = 0; i < MAX_NUM_SOURCES; i++)
+      egl_free_source(ctx, &ctx->sources[i]);
 
-    if (ctx->fragment_shader)
-      glDeleteShader(ctx->fragment_shader);
+    egl_free_program(&ctx->own_program);
+  }
 
-    if (ctx->vertex_shader)
-      glDeleteShader(ctx->vertex_shader);
+  if (ctx->egl_display != EGL_NO_DISPLAY) {
+    eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
 
-    for (i = 0; i < ctx->num_surfaces; i++) {
-      if (ctx->egl_surfaces[i] != EGL_NO_SURFACE)
-        eglDestroySurface(ctx->egl_display, ctx->egl_surfaces[i]);
-    }
+    for (i = 0; i < MAX_NUM_BUCKETS; i++)
+      egl_destroy_bucket(ctx, &ctx->buckets[i]);
 
     if (ctx->egl_context != EGL_NO_CONTEXT)
       eglDestroyContext(ctx->egl_display, ctx->egl_context);
 
-    eglTerminate(ctx->egl_display);
     eglReleaseThread();
   }
 
-  for (i = 0; i < ctx->num_surfaces; i++) {
-    if (ctx->gbm_surfaces[i])
-      gbm_surface_destroy(ctx->gbm_surfaces[i]);
+  if (ctx->fence >= 0)
+    close(ctx->fence);
+
+  if (ctx->dev)
+    egl_put_device(ctx->dev);
+
+  free(ctx);
+}
+
+static int egl_create_surface(egl_ctx *ctx, int width, int height,
+                              struct gbm_surface **gbm_surface,
+                              EGLSurface *egl_surface)
+{
+  if (!ctx->modifier)
+    *gbm_surface = gbm_surface_create(ctx->gbm_dev, width, height,
+                                      ctx->format, GBM_BO_USE_SCANOUT);
+  else
+    *gbm_surface =
+      gbm_surface_create_with_modifiers(ctx->gbm_dev, width, height,
+                                        ctx->format, &ctx->modifier, 1);
+  if (!*gbm_surface) {
+    DRM_ERROR("failed to create GBM surface\n");
+    return -1;
+  }
+
+  *egl_surface =
+    eglCreateWindowSurface(ctx->egl_display, ctx->egl_config,
+                           (EGLNativeWindowType)*gbm_surface, NULL);
+  if (*egl_surface == EGL_NO_SURFACE) {
+    DRM_ERROR("failed to create EGL surface\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int egl_create_bucket(egl_ctx *ctx, egl_bucket *bucket,
+                             int width, int height)
+{
+  int i;
+
+  bucket->width = width;
+  bucket->height = height;
+
+  for (i = 0; i < ctx->num_surfaces; i++) {
+    if (egl_create_surface(ctx, width, height, &bucket->gbm_surfaces[i],
+                           &bucket->egl_surfaces[i]) < 0)
+      goto err;
+  }
+
+  bucket->current_surface = 0;
+  return 0;
+err:
+  egl_destroy_bucket(ctx, bucket);
+  return -1;
+}
+
+static uint32_t egl_bucket_size(egl_ctx *ctx, egl_bucket *bucket)
+{
+  int i, num = ctx->num_surfaces;
+
+  for (i = 0; i < MAX_CACHED_BOS_SYNCED; i++) {
+    if (bucket->cached_bos[i].bo)
+      num++;
+  }
+
+  return bucket->width * bucket->height * 4 * num;
+}
+
+static egl_bucket *egl_get_bucket(egl_ctx *ctx, int width, int height)
+{
+  egl_bucket *bucket, *lru, *free_bucket;
+  uint32_t size, used;
+  int i;
+
+  if (ctx->pool_size) {
+    width = (width + BUCKET_ALIGN - 1) / BUCKET_ALIGN * BUCKET_ALIGN;
+    height = (height + BUCKET_ALIGN - 1) / BUCKET_ALIGN * BUCKET_ALIGN;
+  }
+
+  for (i = 0; i < MAX_NUM_BUCKETS; i++) {
+    bucket = &ctx->buckets[i];
+    if (bucket->width == width && bucket->height == height)
+      return bucket;
+  }
+
+  size = width * height * 4 * ctx->num_surfaces;
+  if (ctx->pool_size && size > ctx->pool_size)
+    DRM_INFO("surfaces of (%dx%d) exceed the pool budget: %uKB > %uKB\n",
+             width, height, size / 1024, ctx->pool_size / 1024);
+
+  while (1) {
+    lru = free_bucket = NULL;
+    used = 0;
+
+    for (i = 0; i < MAX_NUM_BUCKETS; i++) {
+      bucket = &ctx->buckets[i];
+      if (!bucket->width) {
+        free_bucket = bucket;
+        continue;
+      }
+
+      used += egl_bucket_size(ctx, bucket);
+      if (!lru || bucket->last_used < lru->last_used)
+        lru = bucket;
+    }
+
+    if (free_bucket && used + size <= ctx->pool_size)
+      break;
+
+    /* Only the new bucket left */
+    if (!lru)
+      break;
+
+    DRM_DEBUG("destroy surfaces of (%dx%d)\n", lru->width, lru->height);
+
+    eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+    egl_destroy_bucket(ctx, lru);
+  }
+
+  DRM_DEBUG("create surfaces of (%dx%d)\n", width, height);
+
+  if (egl_create_bucket(ctx, free_bucket, width, height) < 0)
+    return NULL;
+
+  return free_bucket;
+}
+
+static EGLConfig egl_choose_config(EGLDisplay display, int format)
+{
+  EGLConfig *configs, config;
+  EGLint num_configs;
+  int i;
+
+  if (!eglGetConfigs(display, NULL, 0, &num_configs) || num_configs < 1) {
+    DRM_ERROR("failed to get configs\n");
+    return NULL;
+  }
+
+  configs = calloc(num_configs, sizeof(*configs));
+  if (!configs) {
+    DRM_ERROR("failed to alloc configs\n");
+    return NULL;
+  }
+
+  if (!eglGetConfigs(display, configs, num_configs, &num_configs)) {
+    DRM_ERROR("failed to get configs\n");
+    free(configs);
+    return NULL;
+  }
+
+  for (i = 0; i < num_configs; i++) {
+    EGLint value;
+
+    if (!eglGetConfigAttrib(display, configs[i], EGL_NATIVE_VISUAL_ID, &value))
+      continue;
+
+    if (value == format)
+      break;
+  }
+
+  if (i == num_configs) {
+    DRM_ERROR("failed to find EGL config for %.4s, force using the first\n",
+              (char *)&format);
+    config = configs[0];
+  } else {
+    config = configs[i];
+  }
+
+  free(configs);
+  return config;
+}
+
+static int egl_has_extension(const char *exts, const char *name)
+{
+  size_t len = strlen(name);
+
+  while (exts && (exts = strstr(exts, name))) {
+    if (exts[len] == ' ' || exts[len] == '\0')
+      return 1;
+    exts += len;
+  }
+
+  return 0;
+}
+
+static void egl_program_cache_init_header(egl_program_cache_header *header)
+{
+  const char *sources[] = { vertex_shader_source, fragment_shader_source };
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  const char *str;
+  unsigned i;
+
+  memset(header, 0, sizeof(*header));
+  header->magic = EGL_PROGRAM_CACHE_MAGIC;
+  header->version = EGL_PROGRAM_CACHE_VERSION;
+
+  /* FNV-1a */
+  for (i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+    for (str = sources[i]; *str; str++) {
+      hash ^= (uint8_t) *str;
+      hash *= 0x100000001b3ULL;
+    }
+  }
+  header->source_hash = hash;
+
+  snprintf(header->vendor, sizeof(header->vendor), "%s",
+           (const char *) glGetString(GL_VENDOR));
+  snprintf(header->renderer, sizeof(header->renderer), "%s",
+           (const char *) glGetString(GL_RENDERER));
+  snprintf(header->gl_version, sizeof(header->gl_version), "%s",
+           (const char *) glGetString(GL_VERSION));
+}
+
+static int egl_load_program(egl_program *program, const char *cache_file)
+{
+  egl_program_cache_header header, expected;
+  struct stat st;
+  void *binary = NULL;
+  GLint status;
+  int fd, ret = -1;
+
+  fd = open(cache_file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  egl_program_cache_init_header(&expected);
+
+  if (fstat(fd, &st) < 0 ||
+      read(fd, &header, sizeof(header)) != sizeof(header))
+    goto out;
+
+  if (header.size > EGL_PROGRAM_CACHE_MAX_SIZE ||
+      (size_t) st.st_size != sizeof(header) + header.size)
+    goto out;
+
+  expected.format = header.format;
+  expected.size = header.size;
+  if (memcmp(&header, &expected, sizeof(header)))
+    goto out;
+
+  binary = malloc(header.size);
+  if (!binary || read(fd, binary, header.size) != (ssize_t) header.size)
+    goto out;
+
+  program->program = glCreateProgram();
+  program_binary(program->program, header.format, binary, header.size);
+
+  /* Rejected by the driver */
+  glGetProgramiv(program->program, GL_LINK_STATUS, &status);
+  if (!status) {
+    glDeleteProgram(program->program);
+    program->program = 0;
+    goto out;
+  }
+
+  ret = 0;
+out:
+  DRM_DEBUG("%s program binary: %s\n",
+            ret ? "failed to load" : "loaded", cache_file);
+  free(binary);
+  close(fd);
+  return ret;
+}
+
+static void egl_save_program(egl_program *program, const char *cache_file)
+{
+  egl_program_cache_header header;
+  char path[PATH_MAX];
+  void *binary;
+  GLint size = 0;
+  GLenum format;
+  int fd;
+
+  glGetProgramiv(program->program, GL_PROGRAM_BINARY_LENGTH_OES, &size);
+  if (size <= 0 || size > EGL_PROGRAM_CACHE_MAX_SIZE)
+    return;
+
+  binary = malloc(size);
+  if (!binary)
+    return;
+
+  get_program_binary(program->program, size, &size, &format, binary);
+
+  egl_program_cache_init_header(&header);
+  header.format = format;
+  header.size = size;
+
+  /* Replace the cache atomically */
+  snprintf(path, sizeof(path), "%s.%d", cache_file, getpid());
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    DRM_DEBUG("failed to create program cache: %s\n", path);
+    free(binary);
+    return;
+  }
+
+  if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+      write(fd, binary, size) != size) {
+    close(fd);
+    goto err;
+  }
+
+  close(fd);
+  if (rename(path, cache_file) < 0)
+    goto err;
+
+  DRM_DEBUG("saved program binary: %s\n", cache_file);
+  free(binary);
+  return;
+err:
+  DRM_DEBUG("failed to save program binary: %s\n", cache_file);
+  unlink(path);
+  free(binary);
+}
+
+/* Should be called with the context current */
+static int egl_init_program(egl_program *program, const char *cache_file)
+{
+  GLint status, num_formats = 0;
+  const char *source;
+  char msg[512];
+
+  /* Skip compiling with the linked binary of last time */
+  if (cache_file &&
+      egl_has_extension((const char *) glGetString(GL_EXTENSIONS),
+                        "GL_OES_get_program_binary")) {
+    if (!get_program_binary)
+      EGL_LOAD_PROC(get_program_binary, PFNGLGETPROGRAMBINARYOESPROC,
+                    "glGetProgramBinaryOES");
+
+    if (!program_binary)
+      EGL_LOAD_PROC(program_binary, PFNGLPROGRAMBINARYOESPROC,
+                    "glProgramBinaryOES");
+
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &num_formats);
+  }
+
+  if (!get_program_binary || !program_binary || num_formats <= 0)
+    cache_file = NULL;
+
+  if (cache_file && !egl_load_program(program, cache_file))
+    goto out;
+
+  source = vertex_shader_source;
+  program->vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(program->vertex_shader, 1, &source, NULL);
+  glCompileShader(program->vertex_shader);
+  glGetShaderiv(program->vertex_shader, GL_COMPILE_STATUS, &status);
+  if (!status) {
+    glGetShaderInfoLog(program->vertex_shader, sizeof(msg), NULL, msg);
+    DRM_ERROR("failed to compile shader: %s\n", msg);
+    return -1;
+  }
+
+  source = fragment_shader_source;
+  program->fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(program->fragment_shader, 1, &source, NULL);
+  glCompileShader(program->fragment_shader);
+  glGetShaderiv(program->fragment_shader, GL_COMPILE_STATUS, &status);
+  if (!status) {
+    glGetShaderInfoLog(program->fragment_shader, sizeof(msg), NULL, msg);
+    DRM_ERROR("failed to compile shader: %s\n", msg);
+    return -1;
+  }
+
+  program->program = glCreateProgram();
+  glAttachShader(program->program, program->vertex_shader);
+  glAttachShader(program->program, program->fragment_shader);
+  glLinkProgram(program->program);
+
+  glGetProgramiv(program->program, GL_LINK_STATUS, &status);
+  if (!status) {
+    glGetProgramInfoLog(program->program, sizeof(msg), NULL, msg);
+    DRM_ERROR("failed to link: %s\n", msg);
+    return -1;
+  }
+
+  if (cache_file)
+    egl_save_program(program, cache_file);
+
+out:
+  /* Uniforms are program states, shared by all contexts */
+  glUseProgram(program->program);
+  glUniform1i(glGetUniformLocation(program->program, "tex"), 0);
+
+  glGenBuffers(1, &program->vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, program->vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+
+  return 0;
+}
+
+static int egl_init_device(egl_device *dev, int fd, int format,
+                           const char *cache_file)
+{
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+  EGLConfig config;
+
+  static const EGLint context_attribs[] = {
+    EGL_CONTEXT_CLIENT_VERSION, 2,
+    EGL_NONE
+  };
+
+  EGL_LOAD_PROC(get_platform_display, PFNEGLGETPLATFORMDISPLAYEXTPROC,
+                "eglGetPlatformDisplayEXT");
+  if (!get_platform_display) {
+    DRM_ERROR("failed to get proc address\n");
+    return -1;
+  }
+
+  dev->gbm_dev = gbm_create_device(fd);
+  if (!dev->gbm_dev) {
+    DRM_ERROR("failed to create gbm device\n");
+    return -1;
+  }
+
+  dev->egl_display = get_platform_display(EGL_PLATFORM_GBM_KHR,
+                                          (void*)dev->gbm_dev, NULL);
+  if (dev->egl_display == EGL_NO_DISPLAY) {
+    DRM_ERROR("failed to get platform display\n");
+    return -1;
+  }
+
+  if (!eglInitialize(dev->egl_display, NULL, NULL)) {
+    DRM_ERROR("failed to init egl\n");
+    return -1;
+  }
+
+  if (egl_has_extension(eglQueryString(dev->egl_display, EGL_EXTENSIONS),
+                        "EGL_ANDROID_native_fence_sync")) {
+    if (!create_sync)
+      EGL_LOAD_PROC(create_sync, PFNEGLCREATESYNCKHRPROC, "eglCreateSyncKHR");
+
+    if (!destroy_sync)
+      EGL_LOAD_PROC(destroy_sync, PFNEGLDESTROYSYNCKHRPROC,
+                    "eglDestroySyncKHR");
+
+    if (!dup_native_fence_fd)
+      EGL_LOAD_PROC(dup_native_fence_fd, PFNEGLDUPNATIVEFENCEFDANDROIDPROC,
+                    "eglDupNativeFenceFDANDROID");
+
+    dev->fence_sync = create_sync && destroy_sync && dup_native_fence_fd;
+  }
+
+  if (!eglBindAPI(EGL_OPENGL_ES_API)) {
+    DRM_ERROR("failed to bind api\n");
+    return -1;
+  }
+
+  config = egl_choose_config(dev->egl_display, format);
+  if (!config)
+    return -1;
+
+  dev->egl_context = eglCreateContext(dev->egl_display, config,
+                                      EGL_NO_CONTEXT, context_attribs);
+  if (dev->egl_context == EGL_NO_CONTEXT) {
+    DRM_ERROR("failed to create EGL context\n");
+    return -1;
   }
 
-  if (ctx->gbm_dev)
-    gbm_device_destroy(ctx->gbm_dev);
+  eglMakeCurrent(dev->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                 dev->egl_context);
 
-  free(ctx);
+  if (egl_init_program(&dev->program, cache_file) < 0) {
+    egl_free_program(&dev->program);
+    eglMakeCurrent(dev->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                   EGL_NO_CONTEXT);
+    return -1;
+  }
+
+  eglMakeCurrent(dev->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                 EGL_NO_CONTEXT);
+  return 0;
 }
 
-static int egl_flush_surfaces(egl_ctx *ctx)
+static egl_device *egl_get_device(int fd, int format, const char *cache_file)
 {
+  egl_device *dev = NULL;
   int i;
 
-  /* Re-create surfaces */
-
-  eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
-                 EGL_NO_CONTEXT);
+  pthread_mutex_lock(&devices_mutex);
 
-  for (i = 0; i < ctx->num_surfaces; i++) {
-    if (ctx->egl_surfaces[i] != EGL_NO_SURFACE) {
-      eglDestroySurface(ctx->egl_display, ctx->egl_surfaces[i]);
-      ctx->egl_surfaces[i] = EGL_NO_SURFACE;
+  for (i = 0; i < MAX_NUM_DEVICES; i++) {
+    if (devices[i].refcnt && devices[i].fd == fd) {
+      dev = &devices[i];
+      dev->refcnt++;
+      goto out;
     }
+
+    if (!dev && !devices[i].refcnt)
+      dev = &devices[i];
   }
 
-  for (i = 0; i < ctx->num_surfaces; i++) {
-    if (ctx->gbm_surfaces[i]) {
-      gbm_surface_destroy(ctx->gbm_surfaces[i]);
-      ctx->gbm_surfaces[i] = NULL;
-    }
+  if (!dev) {
+    DRM_ERROR("too much devices\n");
+    goto out;
   }
 
-  for (i = 0; i < ctx->num_surfaces; i++) {
-    if (!ctx->modifier)
-      ctx->gbm_surfaces[i] =
-        gbm_surface_create(ctx->gbm_dev, ctx->width, ctx->height,
-                           ctx->format, GBM_BO_USE_SCANOUT);
-    else
-      ctx->gbm_surfaces[i] =
-        gbm_surface_create_with_modifiers(ctx->gbm_dev,
-                                          ctx->width, ctx->height,
-                                          ctx->format, &ctx->modifier, 1);
-    if (!ctx->gbm_surfaces[i]) {
-      DRM_ERROR("failed to create GBM surface\n");
-      return -1;
-    }
+  DRM_DEBUG("create EGL device of fd: %d\n", fd);
 
-    ctx->egl_surfaces[i] =
-      eglCreateWindowSurface(ctx->egl_display, ctx->egl_config,
-                             (EGLNativeWindowType)ctx->gbm_surfaces[i], NULL);
-    if (ctx->egl_surfaces[i] == EGL_NO_SURFACE) {
-      DRM_ERROR("failed to create EGL surface\n");
-      return -1;
-    }
+  dev->fd = fd;
+  dev->refcnt = 1;
+  dev->egl_display = EGL_NO_DISPLAY;
+  dev->egl_context = EGL_NO_CONTEXT;
+
+  if (egl_init_device(dev, fd, format, cache_file) < 0) {
+    egl_destroy_device(dev);
+    dev = NULL;
   }
 
-  ctx->current_surface = 0;
-  return 0;
+out:
+  pthread_mutex_unlock(&devices_mutex);
+  return dev;
 }
 
 drm_private void *egl_init_ctx(int fd, int num_surfaces, int format,
-                               uint64_t modifier)
+                               uint64_t modifier, uint32_t pool_size,
+                               const char *cache_file)
 {
-  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
-
-  EGLConfig *configs;
-  EGLint num_configs;
   egl_ctx *ctx;
-
-  GLint texcoord;
-  GLint status;
-  const char *source;
-  char msg[512];
+  GLint position, texcoord;
   int i;
 
   static const EGLint context_attribs[] = {
@@ -200,9 +919,19 @@ drm_private void *egl_init_ctx(int fd, int num_surfaces, int format,
     return NULL;
   }
 
-  EGL_LOAD_PROC(get_platform_display, PFNEGLGETPLATFORMDISPLAYEXTPROC,
-                "eglGetPlatformDisplayEXT");
-  if (!get_platform_display) {
+  if (!create_image)
+    EGL_LOAD_PROC(create_image, PFNEGLCREATEIMAGEKHRPROC,
+                  "eglCreateImageKHR");
+
+  if (!destroy_image)
+    EGL_LOAD_PROC(destroy_image, PFNEGLDESTROYIMAGEKHRPROC,
+                  "eglDestroyImageKHR");
+
+  if (!image_target_texture_2d)
+    EGL_LOAD_PROC(image_target_texture_2d, PFNGLEGLIMAGETARGETTEXTURE2DOESPROC,
+                  "glEGLImageTargetTexture2DOES");
+
+  if (!create_image || !destroy_image || !image_target_texture_2d) {
     DRM_ERROR("failed to get proc address\n");
     return NULL;
   }
@@ -216,121 +945,87 @@ drm_private void *egl_init_ctx(int fd, int num_surfaces, int format,
   ctx->format = format;
   ctx->modifier = modifier;
   ctx->num_surfaces = num_surfaces;
+  ctx->pool_size = pool_size;
+  ctx->fence = -1;
   ctx->width = ctx->height = 0;
+  ctx->egl_display = EGL_NO_DISPLAY;
+  ctx->egl_context = EGL_NO_CONTEXT;
 
-  for (i = 0; i < ctx->num_surfaces; i++)
-    ctx->egl_surfaces[i] = EGL_NO_SURFACE;
+  for (i = 0; i < MAX_NUM_BUCKETS; i++) {
+    for (int j = 0; j < MAX_NUM_SURFACES; j++)
+      ctx->buckets[i].egl_surfaces[j] = EGL_NO_SURFACE;
 
-  ctx->gbm_dev = gbm_create_device(fd);
-  if (!ctx->gbm_dev) {
-    DRM_ERROR("failed to create gbm device\n");
-    goto err;
+    for (int j = 0; j < MAX_CACHED_BOS_SYNCED; j++)
+      ctx->buckets[i].cached_bos[j].egl_surface = EGL_NO_SURFACE;
   }
 
-  ctx->egl_display = get_platform_display(EGL_PLATFORM_GBM_KHR,
-                                          (void*)ctx->gbm_dev, NULL);
-  if (ctx->egl_display == EGL_NO_DISPLAY) {
-    DRM_ERROR("failed to get platform display\n");
-    goto err;
-  }
+  for (i = 0; i < MAX_NUM_SOURCES; i++)
+    ctx->sources[i].image = EGL_NO_IMAGE_KHR;
 
-  if (!eglInitialize(ctx->egl_display, NULL, NULL)) {
-    DRM_ERROR("failed to init egl\n");
+  ctx->dev = egl_get_device(fd, format, cache_file);
+  if (!ctx->dev)
     goto err;
-  }
 
-  if (!eglBindAPI(EGL_OPENGL_ES_API)) {
-    DRM_ERROR("failed to bind api\n");
-    goto err;
-  }
+  ctx->gbm_dev = ctx->dev->gbm_dev;
+  ctx->egl_display = ctx->dev->egl_display;
+  ctx->fence_sync = ctx->dev->fence_sync;
 
-  if (!eglGetConfigs(ctx->egl_display, NULL, 0, &num_configs) ||
-      num_configs < 1) {
-    DRM_ERROR("failed to get configs\n");
-    goto err;
+  /* Sync with fences instead of the multiple surfaces hack */
+  if (ctx->fence_sync) {
+    DRM_DEBUG("using fence synced buffer ring\n");
+    ctx->num_surfaces = 1;
   }
 
-  configs = calloc(num_configs, sizeof(*configs));
-  if (!configs) {
-    DRM_ERROR("failed to alloc configs\n");
+  /* EGL APIs are bound per thread */
+  if (!eglBindAPI(EGL_OPENGL_ES_API)) {
+    DRM_ERROR("failed to bind api\n");
     goto err;
   }
 
-  if (!eglGetConfigs(ctx->egl_display, configs, num_configs, &num_configs)) {
-    DRM_ERROR("failed to get configs\n");
+  ctx->egl_config = egl_choose_config(ctx->egl_display, format);
+  if (!ctx->egl_config)
     goto err;
-  }
-
-  for (i = 0; i < num_configs; i++) {
-    EGLint value;
-
-    if (!eglGetConfigAttrib(ctx->egl_display, configs[i],
-                            EGL_NATIVE_VISUAL_ID, &value))
-      continue;
-
-    if (value == format)
-      break;
-  }
-
-  if (i == num_configs) {
-    DRM_ERROR("failed to find EGL config for %.4s, force using the first\n",
-              (char *)&format);
-    ctx->egl_config = configs[0];
-  } else {
-    ctx->egl_config = configs[i];
-  }
 
+  ctx->program = &ctx->dev->program;
   ctx->egl_context = eglCreateContext(ctx->egl_display, ctx->egl_config,
-                                      EGL_NO_CONTEXT, context_attribs);
+                                      ctx->dev->egl_context, context_attribs);
   if (ctx->egl_context == EGL_NO_CONTEXT) {
-    DRM_ERROR("failed to create EGL context\n");
-    goto err;
+    DRM_DEBUG("failed to create shared EGL context\n");
+
+    /* Fallback to a standalone context */
+    ctx->program = &ctx->own_program;
+    ctx->egl_context = eglCreateContext(ctx->egl_display, ctx->egl_config,
+                                        EGL_NO_CONTEXT, context_attribs);
+    if (ctx->egl_context == EGL_NO_CONTEXT) {
+      DRM_ERROR("failed to create EGL context\n");
+      goto err;
+    }
   }
 
   eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
                  ctx->egl_context);
 
-  source = vertex_shader_source;
-  ctx->vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(ctx->vertex_shader, 1, &source, NULL);
-  glCompileShader(ctx->vertex_shader);
-  glGetShaderiv(ctx->vertex_shader, GL_COMPILE_STATUS, &status);
-  if (!status) {
-    glGetShaderInfoLog(ctx->vertex_shader, sizeof(msg), NULL, msg);
-    DRM_ERROR("failed to compile shader: %s\n", msg);
-    goto err;
-  }
-
-  source = fragment_shader_source;
-  ctx->fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(ctx->fragment_shader, 1, &source, NULL);
-  glCompileShader(ctx->fragment_shader);
-  glGetShaderiv(ctx->fragment_shader, GL_COMPILE_STATUS, &status);
-  if (!status) {
-    glGetShaderInfoLog(ctx->fragment_shader, sizeof(msg), NULL, msg);
-    DRM_ERROR("failed to compile shader: %s\n", msg);
+  if (ctx->program == &ctx->own_program &&
+      egl_init_program(ctx->program, cache_file) < 0)
     goto err;
-  }
-
-  ctx->program = glCreateProgram();
-  glAttachShader(ctx->program, ctx->vertex_shader);
-  glAttachShader(ctx->program, ctx->fragment_shader);
-  glLinkProgram(ctx->program);
 
-  glGetProgramiv(ctx->program, GL_LINK_STATUS, &status);
-  if (!status) {
-    glGetProgramInfoLog(ctx->program, sizeof(msg), NULL, msg);
-    DRM_ERROR("failed to link: %s\n", msg);
-    goto err;
-  }
+  /* Vertex attributes are context states */
+  glUseProgram(ctx->program->program);
+  glBindBuffer(GL_ARRAY_BUFFER, ctx->program->vbo);
 
-  glUseProgram(ctx->program);
+  position = glGetAttribLocation(ctx->program->program, "position");
+  glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, 0);
+  glEnableVertexAttribArray(position);
 
-  texcoord = glGetAttribLocation(ctx->program, "texcoord");
-  glVertexAttribPointer(texcoord, 2, GL_FLOAT, GL_FALSE, 0, texcoords);
+  texcoord = glGetAttribLocation(ctx->program->program, "texcoord");
+  glVertexAttribPointer(texcoord, 2, GL_FLOAT, GL_FALSE, 0,
+                        (void *)(8 * sizeof(GLfloat)));
   glEnableVertexAttribArray(texcoord);
 
-  glUniform1i(glGetUniformLocation(ctx->program, "tex"), 0);
+  /* Constant per draw, not racing with other contexts like uniforms */
+  ctx->offset_attrib = glGetAttribLocation(ctx->program->program, "offset");
+
+  glActiveTexture(GL_TEXTURE0);
 
   return ctx;
 err:
@@ -372,12 +1067,16 @@ static uint32_t egl_bo_to_fb(int fd, struct gbm_bo* bo, int format,
   return fb;
 }
 
-static int egl_attach_dmabuf(egl_ctx *ctx, int dma_fd, int width, int height)
+static int egl_import_source(egl_ctx *ctx, egl_source *src, int fd,
+                             uint32_t handle, int width, int height)
 {
-  static PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d = NULL;
-  static PFNEGLCREATEIMAGEKHRPROC create_image = NULL;
-  static PFNEGLDESTROYIMAGEKHRPROC destroy_image = NULL;
   EGLImageKHR image;
+  int dma_fd;
+
+  if (drmPrimeHandleToFD(fd, handle, DRM_CLOEXEC, &dma_fd) < 0) {
+    DRM_ERROR("failed to get dma fd (-%d)\n", errno);
+    return -1;
+  }
 
   /* Cursor format should be ARGB8888 */
   const EGLint attrs[] = {
@@ -395,104 +1094,322 @@ static int egl_attach_dmabuf(egl_ctx *ctx, int dma_fd, int width, int height)
     EGL_NONE,
   };
 
-  if (!create_image)
-    EGL_LOAD_PROC(create_image, PFNEGLCREATEIMAGEKHRPROC,
-                  "eglCreateImageKHR");
-
-  if (!destroy_image)
-    EGL_LOAD_PROC(destroy_image, PFNEGLDESTROYIMAGEKHRPROC,
-                  "eglDestroyImageKHR");
-
-  if (!image_target_texture_2d)
-    EGL_LOAD_PROC(image_target_texture_2d, PFNGLEGLIMAGETARGETTEXTURE2DOESPROC,
-                  "glEGLImageTargetTexture2DOES");
-
-  if (!create_image || !destroy_image || !image_target_texture_2d) {
-    DRM_ERROR("failed to get proc address\n");
-    return -1;
-  }
-
+  /* The image holds the dma-buf */
   image = create_image(ctx->egl_display, EGL_NO_CONTEXT,
                        EGL_LINUX_DMA_BUF_EXT, NULL, attrs);
+  close(dma_fd);
+
   if (image == EGL_NO_IMAGE) {
     DRM_ERROR("failed to create egl image: 0x%x\n", eglGetError());
     return -1;
   }
 
+  src->handle = handle;
+  src->width = width;
+  src->height = height;
+  src->image = image;
+
+  glGenTextures(1, &src->texture);
+  glBindTexture(GL_TEXTURE_EXTERNAL_OES, src->texture);
   image_target_texture_2d(GL_TEXTURE_EXTERNAL_OES, (GLeglImageOES)image);
-  destroy_image(ctx->egl_display, image);
   return 0;
 }
 
-drm_private uint32_t egl_convert_fb(int fd, void *data, uint32_t handle,
-                                    int w, int h, int scaled_w, int scaled_h,
-                                    int x, int y)
+static int egl_bind_source(egl_ctx *ctx, int fd, uint32_t handle,
+                           int width, int height)
+{
+  egl_source *src = NULL;
+  int i;
+
+  for (i = 0; i < MAX_NUM_SOURCES; i++) {
+    egl_source *tmp = &ctx->sources[i];
+
+    if (tmp->texture && tmp->handle == handle &&
+        tmp->width == width && tmp->height == height) {
+      glBindTexture(GL_TEXTURE_EXTERNAL_OES, tmp->texture);
+      tmp->last_used = ++ctx->source_tick;
+      return 0;
+    }
+
+    /* Replace the least recently used one */
+    if (!src || tmp->last_used < src->last_used)
+      src = tmp;
+  }
+
+  egl_free_source(ctx, src);
+  if (egl_import_source(ctx, src, fd, handle, width, height) < 0) {
+    egl_free_source(ctx, src);
+    return -1;
+  }
+
+  src->last_used = ++ctx->source_tick;
+  return 0;
+}
+
+drm_private void egl_invalidate(void *data, uint32_t handle)
 {
   egl_ctx *ctx = data;
-  GLint position;
-  GLuint texture;
-  struct gbm_bo* bo;
-  uint32_t fb = 0;
-  int dma_fd;
+  int i;
 
-  GLfloat verts[] = {
-    -1.0f, -1.0f,
-     1.0f, -1.0f,
-    -1.0f,  1.0f,
-     1.0f,  1.0f,
-  };
+  for (i = 0; i < MAX_NUM_SOURCES; i++) {
+    egl_source *src = &ctx->sources[i];
 
-  if (drmPrimeHandleToFD(fd, handle, DRM_CLOEXEC, &dma_fd) < 0) {
-    DRM_ERROR("failed to get dma fd (-%d)\n", errno);
-    return 0;
+    if (src->texture && src->handle == handle) {
+      eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                     ctx->egl_context);
+      egl_free_source(ctx, src);
+    }
   }
+}
 
-  if (ctx->width != scaled_w || ctx->height != scaled_h) {
-    ctx->width = scaled_w;
-    ctx->height = scaled_h;
-    glViewport(0, 0, ctx->width, ctx->height);
+static egl_kept_bo *egl_get_free_kept_bo(egl_bucket *bucket, int surface)
+{
+  int i;
 
-    egl_flush_surfaces(ctx);
+  for (i = 0; i < MAX_KEPT_BOS; i++) {
+    if (!bucket->kept_bos[surface][i].bo)
+      return &bucket->kept_bos[surface][i];
   }
 
-  ctx->current_surface = (ctx->current_surface + 1) % ctx->num_surfaces;
-  eglMakeCurrent(ctx->egl_display, ctx->egl_surfaces[ctx->current_surface],
-                 ctx->egl_surfaces[ctx->current_surface],
-                 ctx->egl_context);
+  return NULL;
+}
 
-  /* Apply offsets */
-  for (int i = 0; i < 4; i++) {
-    verts[2 * i] += x * 2.0 / ctx->width;
-    verts[2 * i + 1] -= y * 2.0 / ctx->height;
+static int egl_num_cached_bos(egl_bucket *bucket, int surface)
+{
+  int i, num = 0;
+
+  for (i = 0; i < MAX_KEPT_BOS; i++) {
+    if (bucket->kept_bos[surface][i].cached)
+      num++;
   }
 
-  position = glGetAttribLocation(ctx->program, "position");
-  glVertexAttribPointer(position, 2, GL_FLOAT, GL_FALSE, 0, verts);
-  glEnableVertexAttribArray(position);
+  return num;
+}
 
-  glGenTextures(1, &texture);
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
+/* Whether the ring has a buffer retired by the display to render into */
+static int egl_has_free_bo(egl_bucket *bucket, int surface)
+{
+  return egl_get_free_kept_bo(bucket, surface) &&
+    gbm_surface_has_free_buffers(bucket->gbm_surfaces[surface]);
+}
+
+drm_private void egl_release_fb(void *data, uint32_t fb)
+{
+  egl_ctx *ctx = data;
+  int i, j, k;
+
+  for (i = 0; i < MAX_NUM_BUCKETS; i++) {
+    egl_bucket *bucket = &ctx->buckets[i];
+
+    for (j = 0; bucket->width && j < MAX_CACHED_BOS_SYNCED; j++) {
+      if (bucket->cached_bos[j].bo && bucket->cached_bos[j].fb == fb) {
+        eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                       ctx->egl_context);
+        egl_destroy_cached_bo(ctx, &bucket->cached_bos[j]);
+        return;
+      }
+    }
+
+    for (j = 0; bucket->width && j < ctx->num_surfaces; j++) {
+      for (k = 0; k < MAX_KEPT_BOS; k++) {
+        egl_kept_bo *kept = &bucket->kept_bos[j][k];
+
+        if (kept->bo && kept->fb == fb) {
+          gbm_surface_release_buffer(bucket->gbm_surfaces[j], kept->bo);
+          memset(kept, 0, sizeof(*kept));
+          return;
+        }
+      }
+    }
+  }
+}
+
+/* Render into the surface, returns its locked front buffer */
+static struct gbm_bo *egl_render(egl_ctx *ctx, egl_bucket *bucket,
+                                 struct gbm_surface *gbm_surface,
+                                 EGLSurface egl_surface, int fd,
+                                 uint32_t handle, int w, int h, int x, int y)
+{
+  EGLSyncKHR sync = EGL_NO_SYNC_KHR;
+  struct gbm_bo* bo;
+
+  eglMakeCurrent(ctx->egl_display, egl_surface, egl_surface,
+                 ctx->egl_context);
+
+  /**
+   * Render at the top-left corner of the bucket, the plane's SRC rect
+   * selects it.
+   * Contexts of other CRTCs might be current in the same thread before.
+   */
+  glViewport(0, bucket->height - ctx->height, ctx->width, ctx->height);
 
-  if (egl_attach_dmabuf(ctx, dma_fd, w, h) < 0) {
+  /* Apply offsets */
+  glVertexAttrib2f(ctx->offset_attrib,
+                   x * 2.0 / ctx->width, -y * 2.0 / ctx->height);
+
+  if (egl_bind_source(ctx, fd, handle, w, h) < 0) {
     DRM_ERROR("failed to attach dmabuf\n");
-    goto err_del_texture;
+    return NULL;
   }
 
   glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-  eglSwapBuffers(ctx->egl_display, ctx->egl_surfaces[ctx->current_surface]);
 
-  bo = gbm_surface_lock_front_buffer(ctx->gbm_surfaces[ctx->current_surface]);
-  if (!bo) {
+  if (ctx->fence_sync)
+    sync = create_sync(ctx->egl_display, EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+
+  eglSwapBuffers(ctx->egl_display, egl_surface);
+
+  /* The fence is available after flushed by the swap */
+  if (sync != EGL_NO_SYNC_KHR) {
+    if (ctx->fence >= 0)
+      close(ctx->fence);
+
+    ctx->fence = dup_native_fence_fd(ctx->egl_display, sync);
+    if (ctx->fence == EGL_NO_NATIVE_FENCE_FD_ANDROID)
+      ctx->fence = -1;
+
+    destroy_sync(ctx->egl_display, sync);
+  }
+
+  bo = gbm_surface_lock_front_buffer(gbm_surface);
+  if (!bo)
     DRM_ERROR("failed to get front bo\n");
-    goto err_del_texture;
+
+  return bo;
+}
+
+/* Render a cached FB into a standalone surface, outside of the ring */
+static uint32_t egl_convert_cached_fb(egl_ctx *ctx, egl_bucket *bucket,
+                                      int fd, uint32_t handle, int w, int h,
+                                      int x, int y)
+{
+  egl_cached_bo *cached = NULL;
+  int i;
+
+  for (i = 0; i < MAX_CACHED_BOS_SYNCED; i++) {
+    if (!bucket->cached_bos[i].gbm_surface) {
+      cached = &bucket->cached_bos[i];
+      break;
+    }
+  }
+
+  if (!cached)
+    return 0;
+
+  if (egl_create_surface(ctx, bucket->width, bucket->height,
+                         &cached->gbm_surface, &cached->egl_surface) < 0)
+    goto err;
+
+  cached->bo = egl_render(ctx, bucket, cached->gbm_surface,
+                          cached->egl_surface, fd, handle, w, h, x, y);
+  if (!cached->bo)
+    goto err;
+
+  cached->fb = egl_bo_to_fb(fd, cached->bo, ctx->format, ctx->modifier);
+  if (!cached->fb)
+    goto err;
+
+  return cached->fb;
+err:
+  eglMakeCurrent(ctx->egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE,
+                 ctx->egl_context);
+  egl_destroy_cached_bo(ctx, cached);
+  return 0;
+}
+
+drm_private uint32_t egl_convert_fb(int fd, void *data, uint32_t handle,
+                                    int w, int h, int scaled_w, int scaled_h,
+                                    int x, int y, int *keep)
+{
+  egl_ctx *ctx = data;
+  egl_kept_bo *kept = NULL;
+  egl_bucket *bucket;
+  int want_keep = keep && *keep;
+  int surface, cached = 0;
+  struct gbm_bo* bo;
+  uint32_t fb;
+
+  if (keep)
+    *keep = 0;
+
+  if (!ctx->bucket || ctx->width != scaled_w || ctx->height != scaled_h) {
+    ctx->bucket = egl_get_bucket(ctx, scaled_w, scaled_h);
+    if (!ctx->bucket) {
+      DRM_ERROR("failed to get surfaces for (%dx%d)\n", scaled_w, scaled_h);
+      return 0;
+    }
+
+    ctx->width = scaled_w;
+    ctx->height = scaled_h;
+  }
+
+  bucket = ctx->bucket;
+  bucket->last_used = ++ctx->bucket_tick;
+
+  /* Cached FBs would hold the ring's buffers for long */
+  if (ctx->fence_sync && want_keep) {
+    fb = egl_convert_cached_fb(ctx, bucket, fd, handle, w, h, x, y);
+    if (fb) {
+      *keep = 1;
+      return fb;
+    }
+  }
+
+  bucket->current_surface = (bucket->current_surface + 1) % ctx->num_surfaces;
+  surface = bucket->current_surface;
+
+  /* Never render into buffers not yet retired, they might be on screen */
+  if (ctx->fence_sync && !egl_has_free_bo(bucket, surface)) {
+    DRM_DEBUG("ring exhausted\n");
+    errno = EBUSY;
+    return 0;
   }
 
+  bo = egl_render(ctx, bucket, bucket->gbm_surfaces[surface],
+                  bucket->egl_surfaces[surface], fd, handle, w, h, x, y);
+  if (!bo)
+    return 0;
+
   fb = egl_bo_to_fb(fd, bo, ctx->format, ctx->modifier);
-  gbm_surface_release_buffer(ctx->gbm_surfaces[ctx->current_surface], bo);
 
-err_del_texture:
-  glDeleteTextures(1, &texture);
-  close(dma_fd);
+  /* Keep the buffer from reusing until retired, or cached when requested */
+  if (fb && ctx->fence_sync) {
+    kept = egl_get_free_kept_bo(bucket, surface);
+  } else if (fb && want_keep &&
+             egl_num_cached_bos(bucket, surface) < MAX_CACHED_BOS) {
+    kept = egl_get_free_kept_bo(bucket, surface);
+    cached = kept != NULL;
+  }
+
+  if (keep)
+    *keep = cached;
+
+  if (kept) {
+    kept->bo = bo;
+    kept->fb = fb;
+    kept->cached = cached;
+  } else {
+    gbm_surface_release_buffer(bucket->gbm_surfaces[surface], bo);
+  }
+
   return fb;
 }
+
+drm_private int egl_take_fence(void *data)
+{
+  egl_ctx *ctx = data;
+  int fence = ctx->fence;
+
+  ctx->fence = -1;
+  return fence;
+}
+
+drm_private const drm_backend egl_backend = {
+  .name = "egl",
+  .init_ctx = egl_init_ctx,
+  .free_ctx = egl_free_ctx,
+  .convert_fb = egl_convert_fb,
+  .release_fb = egl_release_fb,
+  .invalidate = egl_invalidate,
+  .take_fence = egl_take_fence,
+};
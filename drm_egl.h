@@ -19,8 +19,11 @@
 
 #include "drm_common.h"
 
-drm_private void *egl_init_ctx(int fd, int num_surfaces, int format, uint64_t modifier);
+drm_private void *egl_init_ctx(int fd, int num_surfaces, int format, uint64_t modifier, uint32_t pool_size, const char *cache_file);
 drm_private void egl_free_ctx(void *data);
-drm_private uint32_t egl_convert_fb(int fd, void *data, uint32_t handle, int w, int h, int scaled_w, int scaled_h, int x, int y);
+drm_private uint32_t egl_convert_fb(int fd, void *data, uint32_t handle, int w, int h, int scaled_w, int scaled_h, int x, int y, int *keep);
+drm_private void egl_release_fb(void *data, uint32_t fb);
+drm_private void egl_invalidate(void *data, uint32_t handle);
+drm_private int egl_take_fence(void *data);
 
 #endif
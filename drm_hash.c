@@ -0,0 +1,133 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#endif
+
+#include "drm_common.h"
+#include "drm_hash.h"
+
+/**
+ * Hashing cursor pixels in 4 independent 32-bit lanes (like xxHash32), so
+ * that the rounds map onto SIMD registers, then folding into 64 bits.
+ */
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+
+static inline uint32_t rotl32(uint32_t x, int r)
+{
+  return (x << r) | (x >> (32 - r));
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline uint32_t hash_round(uint32_t acc, uint32_t input)
+{
+  acc += input * PRIME32_2;
+  acc = rotl32(acc, 13);
+  return acc * PRIME32_1;
+}
+
+/* Hash the 16-byte stripes, returns the number of them */
+static size_t hash_stripes(uint32_t lanes[4], const uint8_t *data, size_t size)
+{
+  size_t i = 0, n = size / 16;
+
+#if defined(__ARM_NEON)
+  uint32x4_t acc = vld1q_u32(lanes);
+  const uint32x4_t p1 = vdupq_n_u32(PRIME32_1);
+  const uint32x4_t p2 = vdupq_n_u32(PRIME32_2);
+
+  for (; i < n; i++) {
+    acc = vmlaq_u32(acc, vld1q_u32((const uint32_t *)(data + i * 16)), p2);
+    acc = vorrq_u32(vshlq_n_u32(acc, 13), vshrq_n_u32(acc, 19));
+    acc = vmulq_u32(acc, p1);
+  }
+
+  vst1q_u32(lanes, acc);
+#elif defined(__SSE4_1__)
+  __m128i acc = _mm_loadu_si128((const __m128i *)lanes);
+  const __m128i p1 = _mm_set1_epi32(PRIME32_1);
+  const __m128i p2 = _mm_set1_epi32(PRIME32_2);
+
+  for (; i < n; i++) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + i * 16));
+
+    acc = _mm_add_epi32(acc, _mm_mullo_epi32(v, p2));
+    acc = _mm_or_si128(_mm_slli_epi32(acc, 13), _mm_srli_epi32(acc, 19));
+    acc = _mm_mullo_epi32(acc, p1);
+  }
+
+  _mm_storeu_si128((__m128i *)lanes, acc);
+#endif
+
+  for (; i < n; i++) {
+    uint32_t v[4];
+
+    memcpy(v, data + i * 16, sizeof(v));
+    lanes[0] = hash_round(lanes[0], v[0]);
+    lanes[1] = hash_round(lanes[1], v[1]);
+    lanes[2] = hash_round(lanes[2], v[2]);
+    lanes[3] = hash_round(lanes[3], v[3]);
+  }
+
+  return n;
+}
+
+/* 64-bit content hash of ARGB8888 pixels, never 0 */
+drm_private uint64_t drm_hash_pixels(const void *data, size_t size)
+{
+  uint32_t lanes[4] = {
+    PRIME32_1 + PRIME32_2, PRIME32_2, 0, -PRIME32_1,
+  };
+  const uint8_t *ptr = data;
+  uint64_t hash;
+  size_t i;
+
+  i = hash_stripes(lanes, ptr, size) * 16;
+
+  hash = ((uint64_t) lanes[0] << 32 | lanes[1]) * PRIME64_1;
+  hash ^= rotl64(((uint64_t) lanes[2] << 32 | lanes[3]) * PRIME64_2, 31);
+  hash += size;
+
+  /* Remaining pixels */
+  for (; i + 4 <= size; i += 4) {
+    uint32_t v;
+
+    memcpy(&v, ptr + i, sizeof(v));
+    hash ^= v * PRIME64_1;
+    hash = rotl64(hash, 23) * PRIME64_2 + PRIME64_3;
+  }
+
+  /* Avalanche */
+  hash ^= hash >> 33;
+  hash *= PRIME64_2;
+  hash ^= hash >> 29;
+  hash *= PRIME64_3;
+  hash ^= hash >> 32;
+
+  return hash ? hash : 1;
+}
@@ -0,0 +1,26 @@
+/*
+ *  Copyright (c) 2021, Jeffy Chen <jeffy.chen@rock-chips.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+
+#ifndef __DRM_HASH_H_
+#define __DRM_HASH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "drm_common.h"
+
+drm_private uint64_t drm_hash_pixels(const void *data, size_t size);
+
+#endif
@@ -1,5 +1,9 @@
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <xf86drm.h>
 #include <sys/mman.h>
@@ -7,11 +11,108 @@
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 
+#include "drm_cpu.h"
+
 #define CURSOR_WIDTH 64
 #define CURSOR_HEIGHT 64
 
+#define BENCH_SAMPLES 100000
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Measure drmModeMoveCursor() caller latency at the given rate */
+static void bench_move(int fd, int crtc_id, int rate)
+{
+  static uint64_t samples[BENCH_SAMPLES];
+  uint64_t period, next, start;
+  struct timespec ts;
+
+  if (rate <= 0)
+    rate = 20000;
+
+  period = 1000000000ULL / rate;
+  next = now_ns();
+
+  for (int i = 0; i < BENCH_SAMPLES; i++) {
+    ts.tv_sec = next / 1000000000ULL;
+    ts.tv_nsec = next % 1000000000ULL;
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    next += period;
+
+    start = now_ns();
+    drmModeMoveCursor(fd, crtc_id, i % 1024, i % 768);
+    samples[i] = now_ns() - start;
+  }
+
+  qsort(samples, BENCH_SAMPLES, sizeof(samples[0]), cmp_u64);
+  printf("move %d samples at %d Hz: p50 %lluns p99 %lluns max %lluns\n",
+         BENCH_SAMPLES, rate,
+         (unsigned long long)samples[BENCH_SAMPLES / 2],
+         (unsigned long long)samples[BENCH_SAMPLES * 99 / 100],
+         (unsigned long long)samples[BENCH_SAMPLES - 1]);
+}
+
+/* Compare the CPU backend's SIMD and scalar kernels, no device needed */
+static void bench_cpu(int loops)
+{
+  static const struct {
+    int w, h, scaled_w, scaled_h, format;
+  } cases[] = {
+    { 64, 64, 64, 64, DRM_FORMAT_ARGB8888 },
+    { 64, 64, 64, 64, DRM_FORMAT_ABGR8888 },
+    { 64, 64, 96, 96, DRM_FORMAT_ARGB8888 },
+    { 64, 64, 48, 48, DRM_FORMAT_ABGR8888 },
+    { 64, 64, 128, 128, DRM_FORMAT_ABGR8888 },
+  };
+  static uint32_t src[CURSOR_WIDTH * CURSOR_HEIGHT];
+  static uint32_t dst[2][128 * 128];
+  uint64_t ns[2], start;
+
+  if (loops <= 0)
+    loops = 10000;
+
+  for (int i = 0; i < CURSOR_WIDTH * CURSOR_HEIGHT; i++)
+    src[i] = 0x4F000000 | (i % CURSOR_WIDTH) * 2 << 16 |
+      (i / CURSOR_WIDTH) << 8 | (i * 7 & 0xff);
+
+  for (unsigned c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+    for (int simd = 0; simd < 2; simd++) {
+      start = now_ns();
+      for (int i = 0; i < loops; i++)
+        cpu_render_image(dst[simd], src, cases[c].w, cases[c].h,
+                         cases[c].scaled_w, cases[c].scaled_h,
+                         cases[c].format, simd);
+      ns[simd] = (now_ns() - start) / loops;
+    }
+
+    printf("cpu %dx%d -> %dx%d %s: scalar %lluns simd %lluns%s\n",
+           cases[c].w, cases[c].h, cases[c].scaled_w, cases[c].scaled_h,
+           cases[c].format == DRM_FORMAT_ARGB8888 ? "ARGB" : "ABGR",
+           (unsigned long long)ns[0], (unsigned long long)ns[1],
+           memcmp(dst[0], dst[1], cases[c].scaled_w * cases[c].scaled_h * 4) ?
+           " (MISMATCH)" : "");
+  }
+}
+
 int main(int argc, const char **argv)
 {
+  if (argc > 1 && !strcmp(argv[1], "cpu-bench")) {
+    bench_cpu(argc > 2 ? atoi(argv[2]) : 0);
+    return 0;
+  }
+
   int fd = open("/dev/dri/card0", O_RDWR | O_CLOEXEC);
   int width = CURSOR_WIDTH;
   int height = CURSOR_HEIGHT;
@@ -46,6 +147,11 @@ int main(int argc, const char **argv)
 
   drmModeSetCursor(fd, crtc_id, handle, width, height);
 
+  if (argc > 3) {
+    bench_move(fd, crtc_id, atoi(argv[3]));
+    return 0;
+  }
+
   for (int i = 0; i < 100000; i++) {
     drmModeMoveCursor(fd, crtc_id, i % 1024, i % 1024);
     usleep(100000);